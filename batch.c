@@ -0,0 +1,288 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Files smaller than this are handed out to workers several at a time, so
+// that the cost of claiming work stays negligible next to the work itself.
+#define BATCH_SMALL_FILE  (64 * 1024)
+#define BATCH_SMALL_COUNT 16
+
+typedef struct {
+    char *rel;
+    uint64_t size;
+} batch_file_t;
+
+typedef struct {
+    char *indir;
+    char *outdir;
+    batch_fn fn;
+    void *ctx;
+    batch_file_t *files;
+    size_t nfiles;
+    size_t cap;
+    size_t next;
+    uint32_t failed;
+    dev_t out_dev;
+    ino_t out_ino;
+    pthread_mutex_t lock;
+} batch_t;
+
+// Returns the number of online processors, which is the default number of
+// worker threads for batch mode.
+//
+// Input parameters: None
+// Returns: uint32_t: Number of threads to use
+uint32_t batch_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t) n : 1;
+}
+
+// Appends a file to the work list.
+//
+// Input parameters:
+// b: batch_t *: Batch state
+// rel: char *: Path of the file relative to the input directory
+// size: uint64_t: Size of the file in bytes
+// Returns: void
+static void batch_add(batch_t *b, char *rel, uint64_t size) {
+    if (b->nfiles == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 64;
+        b->files = (batch_file_t *) realloc(b->files, b->cap * sizeof(batch_file_t));
+    }
+    b->files[b->nfiles].rel = strdup(rel);
+    b->files[b->nfiles].size = size;
+    b->nfiles++;
+}
+
+// Recursively collects the regular files under indir/rel, creating the
+// matching directories under outdir as it goes.
+//
+// Input parameters:
+// b: batch_t *: Batch state
+// rel: char *: Directory relative to the input directory ("" for the top)
+// Returns: int: 0 in case of success, -1 if a directory could not be read
+static int batch_walk(batch_t *b, char *rel) {
+    char in_path[PATH_MAX], out_path[PATH_MAX], child[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+
+    snprintf(in_path, sizeof(in_path), "%s/%s", b->indir, rel);
+    if ((dir = opendir(in_path)) == NULL) {
+        printf("Could not read directory %s\n", in_path);
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", de->d_name)
+                >= (int) sizeof(child)
+            || snprintf(in_path, sizeof(in_path), "%s/%s", b->indir, child) >= (int) sizeof(in_path)
+            || stat(in_path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            // Never descend into the output tree if it lives inside the input.
+            if (st.st_dev == b->out_dev && st.st_ino == b->out_ino) {
+                continue;
+            }
+            if (snprintf(out_path, sizeof(out_path), "%s/%s", b->outdir, child) >= (int) sizeof(out_path)
+                || (mkdir(out_path, 0755) != 0 && errno != EEXIST)) {
+                printf("Could not create directory %s\n", out_path);
+                closedir(dir);
+                return -1;
+            }
+            if (batch_walk(b, child) != 0) {
+                closedir(dir);
+                return -1;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            batch_add(b, child, st.st_size);
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+// Orders files largest first, so that the big ones start early and the tail
+// of the run is made of small files that balance out across the workers.
+static int batch_cmp(const void *a, const void *b) {
+    const batch_file_t *fa = a, *fb = b;
+    return (fa->size < fb->size) - (fa->size > fb->size);
+}
+
+// Claims the next run of files from the shared queue. Large files are claimed
+// one at a time; small files are claimed in groups of up to BATCH_SMALL_COUNT.
+//
+// Input parameters:
+// b: batch_t *: Batch state
+// first, last: size_t *: The claimed range [first, last) is stored here
+// Returns: bool: False once the queue is empty
+static bool batch_claim(batch_t *b, size_t *first, size_t *last) {
+    pthread_mutex_lock(&b->lock);
+    *first = b->next;
+    *last = b->next;
+    while (*last < b->nfiles && *last - *first < BATCH_SMALL_COUNT) {
+        (*last)++;
+        if (b->files[*last - 1].size >= BATCH_SMALL_FILE) {
+            break;
+        }
+    }
+    b->next = *last;
+    pthread_mutex_unlock(&b->lock);
+    return *first < *last;
+}
+
+// Processes one file from the input tree into the output tree.
+//
+// Input parameters:
+// b: batch_t *: Batch state
+// f: batch_file_t *: File to process
+// Returns: bool: True in case of success
+static bool batch_one(batch_t *b, batch_file_t *f) {
+    char in_path[PATH_MAX], out_path[PATH_MAX];
+    FILE *ifp, *ofp;
+    bool ok;
+
+    snprintf(in_path, sizeof(in_path), "%s/%s", b->indir, f->rel);
+    snprintf(out_path, sizeof(out_path), "%s/%s", b->outdir, f->rel);
+
+    if ((ifp = fopen(in_path, "r")) == NULL) {
+        printf("Could not open input file %s\n", in_path);
+        return false;
+    }
+    if ((ofp = fopen(out_path, "w")) == NULL) {
+        printf("Could not open output file %s\n", out_path);
+        fclose(ifp);
+        return false;
+    }
+
+    if (!(ok = b->fn(ifp, ofp, b->ctx))) {
+        printf("Could not process %s\n", in_path);
+    }
+
+    fclose(ifp);
+    return fclose(ofp) == 0 && ok;
+}
+
+// Frees the work list.
+static void batch_free(batch_t *b) {
+    for (size_t i = 0; i < b->nfiles; i++) {
+        free(b->files[i].rel);
+    }
+    free(b->files);
+    pthread_mutex_destroy(&b->lock);
+}
+
+// Worker thread. Keeps claiming files until the queue is drained.
+static void *batch_worker(void *arg) {
+    batch_t *b = arg;
+    size_t first, last;
+    uint32_t failed = 0;
+
+    while (batch_claim(b, &first, &last)) {
+        for (size_t i = first; i < last; i++) {
+            if (!batch_one(b, &b->files[i])) {
+                failed++;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->failed += failed;
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// Applies fn to every regular file under indir, writing each result to the
+// same relative path under outdir. The caller loads (and verifies) the key
+// once and passes it through ctx; files are spread across nthreads workers.
+//
+// Input parameters:
+// indir: char *: Input directory, walked recursively
+// outdir: char *: Output directory, created if it does not exist
+// fn: batch_fn: Function that processes one file
+// ctx: void *: Context handed to fn
+// nthreads: uint32_t: Number of worker threads
+// verbose: bool: Print each file as it is queued
+// Returns: int: Number of files that failed, or -1 if the tree could not be read
+int batch_run(
+    char *indir, char *outdir, batch_fn fn, void *ctx, uint32_t nthreads, bool verbose) {
+    batch_t b = { 0 };
+    struct timespec start, end;
+    struct stat st;
+    pthread_t *threads;
+    uint64_t total = 0;
+    double secs;
+
+    if (mkdir(outdir, 0755) != 0 && errno != EEXIST) {
+        printf("Could not create directory %s\n", outdir);
+        return -1;
+    }
+    if (stat(outdir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("The output directory %s is invalid\n", outdir);
+        return -1;
+    }
+
+    b.indir = indir;
+    b.outdir = outdir;
+    b.fn = fn;
+    b.ctx = ctx;
+    b.out_dev = st.st_dev;
+    b.out_ino = st.st_ino;
+    pthread_mutex_init(&b.lock, NULL);
+
+    if (batch_walk(&b, "") != 0) {
+        batch_free(&b);
+        return -1;
+    }
+    qsort(b.files, b.nfiles, sizeof(batch_file_t), batch_cmp);
+
+    for (size_t i = 0; i < b.nfiles; i++) {
+        total += b.files[i].size;
+        if (verbose) {
+            printf("queued %s (%" PRIu64 " bytes)\n", b.files[i].rel, b.files[i].size);
+        }
+    }
+
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    if (nthreads > b.nfiles && b.nfiles > 0) {
+        nthreads = b.nfiles;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, batch_worker, &b);
+    }
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+    printf("%zu files, %.2f MB in %.3f s using %u threads: %.1f files/s, %.2f MB/s\n", b.nfiles,
+        total / 1e6, secs, nthreads, b.nfiles / secs, total / 1e6 / secs);
+
+    batch_free(&b);
+    return (int) b.failed;
+}
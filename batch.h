@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Processes a single input stream into a single output stream. ctx is the
+// caller's context (typically the key material), passed through unchanged.
+// Returns false if the stream could not be processed.
+typedef bool (*batch_fn)(FILE *infile, FILE *outfile, void *ctx);
+
+uint32_t batch_default_threads(void);
+
+int batch_run(
+    char *indir, char *outdir, batch_fn fn, void *ctx, uint32_t nthreads, bool verbose);
@@ -0,0 +1,213 @@
+#include "bcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A bounded cache of byte strings, used to memoize the encryption and
+// decryption of repeated blocks. Entries live in a chained hash table and
+// on a doubly linked list in order of use; when the memory taken by the
+// entries would exceed the cap, the least recently used ones are evicted.
+
+#define BCACHE_MIN_BUCKETS 64
+
+typedef struct bcache_entry {
+    struct bcache_entry *chain; // Next entry in the same bucket
+    struct bcache_entry *newer;
+    struct bcache_entry *older;
+    uint64_t hash;
+    size_t klen;
+    size_t vlen;
+    uint8_t data[]; // The key, followed by the value
+} bcache_entry_t;
+
+struct bcache {
+    bcache_entry_t **buckets;
+    size_t nbuckets; // Always a power of 2
+    size_t count;
+    size_t bytes; // Memory taken by the entries
+    size_t cap;
+    bcache_entry_t *newest;
+    bcache_entry_t *oldest;
+};
+
+// Hashes a key, 8 bytes at a time.
+//
+// Input parameters:
+// key: const uint8_t *: Bytes to hash
+// klen: size_t: Number of bytes
+// Returns: uint64_t: The hash
+static uint64_t bcache_hash(const uint8_t *key, size_t klen) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ klen;
+    uint64_t w;
+    size_t i = 0;
+
+    for (; i + 8 <= klen; i += 8) {
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    if (i < klen) {
+        w = 0;
+        memcpy(&w, key + i, klen - i);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Creates an empty cache.
+//
+// Input parameters:
+// cap: size_t: Largest amount of memory, in bytes, the entries may take
+// Returns: bcache_t *: The cache
+bcache_t *bcache_create(size_t cap) {
+    bcache_t *cache = (bcache_t *) calloc(1, sizeof(bcache_t));
+    cache->nbuckets = BCACHE_MIN_BUCKETS;
+    cache->buckets = (bcache_entry_t **) calloc(cache->nbuckets, sizeof(bcache_entry_t *));
+    cache->cap = cap;
+    return cache;
+}
+
+// Frees a cache and all its entries.
+//
+// Input parameters:
+// cache: bcache_t *: The cache
+// Returns: void
+void bcache_delete(bcache_t *cache) {
+    bcache_entry_t *ent = cache->newest;
+    while (ent != NULL) {
+        bcache_entry_t *older = ent->older;
+        free(ent);
+        ent = older;
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+// Removes an entry from the list of entries in order of use.
+static void bcache_unlink(bcache_t *cache, bcache_entry_t *ent) {
+    if (ent->newer != NULL) {
+        ent->newer->older = ent->older;
+    } else {
+        cache->newest = ent->older;
+    }
+    if (ent->older != NULL) {
+        ent->older->newer = ent->newer;
+    } else {
+        cache->oldest = ent->newer;
+    }
+}
+
+// Adds an entry to the list of entries in order of use, as the newest.
+static void bcache_link(bcache_t *cache, bcache_entry_t *ent) {
+    ent->newer = NULL;
+    ent->older = cache->newest;
+    if (cache->newest != NULL) {
+        cache->newest->newer = ent;
+    } else {
+        cache->oldest = ent;
+    }
+    cache->newest = ent;
+}
+
+// Evicts the least recently used entry.
+static void bcache_evict(bcache_t *cache) {
+    bcache_entry_t *ent = cache->oldest;
+    bcache_entry_t **p = &cache->buckets[ent->hash & (cache->nbuckets - 1)];
+
+    while (*p != ent) {
+        p = &(*p)->chain;
+    }
+    *p = ent->chain;
+    bcache_unlink(cache, ent);
+
+    cache->bytes -= sizeof(bcache_entry_t) + ent->klen + ent->vlen;
+    cache->count--;
+    free(ent);
+}
+
+// Doubles the number of buckets.
+static void bcache_grow(bcache_t *cache) {
+    size_t nbuckets = 2 * cache->nbuckets;
+    bcache_entry_t **buckets = (bcache_entry_t **) calloc(nbuckets, sizeof(bcache_entry_t *));
+
+    if (buckets == NULL) {
+        return;
+    }
+    for (bcache_entry_t *ent = cache->newest; ent != NULL; ent = ent->older) {
+        bcache_entry_t **p = &buckets[ent->hash & (nbuckets - 1)];
+        ent->chain = *p;
+        *p = ent;
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+// Looks a key up, marking it as the most recently used on a hit.
+//
+// Input parameters:
+// cache: bcache_t *: The cache
+// key: const uint8_t *: Key to look up
+// klen: size_t: Length of the key
+// vlen: size_t *: Length of the value is stored here on a hit
+// Returns: const uint8_t *: The value, valid until the next bcache_put, or
+// NULL on a miss
+const uint8_t *bcache_get(bcache_t *cache, const uint8_t *key, size_t klen, size_t *vlen) {
+    uint64_t hash = bcache_hash(key, klen);
+    bcache_entry_t *ent = cache->buckets[hash & (cache->nbuckets - 1)];
+
+    for (; ent != NULL; ent = ent->chain) {
+        if (ent->hash == hash && ent->klen == klen && !memcmp(ent->data, key, klen)) {
+            bcache_unlink(cache, ent);
+            bcache_link(cache, ent);
+            *vlen = ent->vlen;
+            return ent->data + klen;
+        }
+    }
+    return NULL;
+}
+
+// Adds a key that is not in the cache, with its value, evicting the least
+// recently used entries as needed to stay within the cap.
+//
+// Input parameters:
+// cache: bcache_t *: The cache
+// key: const uint8_t *: Key to add
+// klen: size_t: Length of the key
+// value: const uint8_t *: Value to add
+// vlen: size_t: Length of the value
+// Returns: void
+void bcache_put(bcache_t *cache, const uint8_t *key, size_t klen, const uint8_t *value, size_t vlen) {
+    size_t size = sizeof(bcache_entry_t) + klen + vlen;
+    bcache_entry_t *ent, **p;
+
+    if (size > cache->cap) {
+        return;
+    }
+    while (cache->bytes + size > cache->cap) {
+        bcache_evict(cache);
+    }
+    if ((ent = (bcache_entry_t *) malloc(size)) == NULL) {
+        return;
+    }
+
+    ent->hash = bcache_hash(key, klen);
+    ent->klen = klen;
+    ent->vlen = vlen;
+    memcpy(ent->data, key, klen);
+    memcpy(ent->data + klen, value, vlen);
+
+    p = &cache->buckets[ent->hash & (cache->nbuckets - 1)];
+    ent->chain = *p;
+    *p = ent;
+    bcache_link(cache, ent);
+    cache->bytes += size;
+    cache->count++;
+
+    if (cache->count > cache->nbuckets) {
+        bcache_grow(cache);
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct bcache bcache_t;
+
+bcache_t *bcache_create(size_t cap);
+
+void bcache_delete(bcache_t *cache);
+
+const uint8_t *bcache_get(bcache_t *cache, const uint8_t *key, size_t klen, size_t *vlen);
+
+void bcache_put(bcache_t *cache, const uint8_t *key, size_t klen, const uint8_t *value, size_t vlen);
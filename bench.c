@@ -0,0 +1,138 @@
+#include "pmul.h"
+#include "randstate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Smallest and largest operand sizes to time, in bits
+#define MIN_BITS (1 << 12)
+#define MAX_BITS (1 << 20)
+
+// Usage Function
+// Input parameters:
+// exec_name: char *: Name of the program
+// Returns: void
+void usage(char *exec_name) {
+    printf("USAGE: %s [-t <threads>][-m <max_bits>][-h]\n", exec_name);
+    printf("-t <threads>: Number of threads to multiply with. Default is the number of CPUs\n");
+    printf("-m <max_bits>: Largest operand size to time. Default is %d\n", MAX_BITS);
+    printf("-h: Print this message\n");
+    return;
+}
+
+// Returns the current time in seconds.
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Times one modular squaring step of pow_mod, the serial GMP way and the
+// parallel way, repeating each for at least 0.2 s.
+//
+// Input parameters:
+// bits: uint64_t: Size of the modulus
+// serial: double *: Time per serial step, in seconds, is stored here
+// parallel: double *: Time per parallel step, in seconds, is stored here
+// Returns: bool: True if both ways gave the same results
+bool time_step(uint64_t bits, double *serial, double *parallel) {
+    mpz_t n, x, y, sq;
+    pmul_mod_t ctx;
+    uint64_t reps;
+    double start;
+    bool same;
+
+    mpz_inits(n, x, y, sq, NULL);
+    randstate_urandomb(n, bits);
+    mpz_setbit(n, bits - 1);
+    randstate_urandomm(x, n);
+    pmul_mod_init(&ctx, n);
+
+    mpz_set(y, x);
+    start = now();
+    for (reps = 0; reps == 0 || now() - start < 0.2; reps++) {
+        mpz_mul(sq, y, y);
+        mpz_mod(y, sq, n);
+    }
+    *serial = (now() - start) / reps;
+
+    // Run the same number of steps from the same start, so that the
+    // results can be compared. x keeps the serial result.
+    mpz_swap(x, y);
+    start = now();
+    for (uint64_t i = 0; i < reps; i++) {
+        pmul_sqr(sq, y);
+        pmul_reduce(&ctx, y, sq);
+    }
+    *parallel = (now() - start) / reps;
+    same = mpz_cmp(x, y) == 0;
+
+    pmul_mod_clear(&ctx);
+    mpz_clears(n, x, y, sq, NULL);
+    return same;
+}
+
+// The main function. Times modular squaring, the bulk of pow_mod, at
+// doubling sizes, and reports the size from which the parallel layer wins.
+//
+// Input parameters:
+// argc: int: Number of input arguments
+// argv: char **: The input arguments
+// Returns: int: 0 in case of success, non-zero for failure
+int main(int argc, char **argv) {
+    int opt;
+    uint32_t nthreads = 0;
+    uint64_t max_bits = MAX_BITS;
+    uint64_t crossover = 0;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "t:m:h")) != -1) {
+        switch (opt) {
+        case ('t'): nthreads = strtoul(optarg, NULL, 10); break;
+        case ('m'): max_bits = strtoul(optarg, NULL, 10); break;
+        case ('h'): usage(argv[0]); return 0;
+        default: usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+
+    randstate_init(1);
+    nthreads = pmul_init(nthreads);
+    printf("%u threads, current threshold %lu bits\n", nthreads, (unsigned long) pmul_threshold);
+
+    // Always split, whatever the size, so that both ways are timed.
+    pmul_threshold = 0;
+
+    printf("%10s %14s %14s %8s\n", "bits", "serial (us)", "parallel (us)", "speedup");
+    for (uint64_t bits = MIN_BITS; bits <= max_bits; bits *= 2) {
+        double serial, parallel;
+        if (!time_step(bits, &serial, &parallel)) {
+            printf("%10lu: results differ\n", (unsigned long) bits);
+            ok = false;
+        }
+        printf("%10lu %14.2f %14.2f %8.2f\n", (unsigned long) bits, serial * 1e6, parallel * 1e6,
+            serial / parallel);
+
+        // The crossover is the smallest size from which the parallel layer
+        // stays ahead.
+        if (serial > parallel && crossover == 0) {
+            crossover = bits;
+        } else if (serial <= parallel) {
+            crossover = 0;
+        }
+    }
+
+    if (nthreads < 2) {
+        printf("Only one thread: pow_mod always uses the serial path\n");
+    } else if (crossover == 0) {
+        printf("No crossover up to %lu bits\n", (unsigned long) max_bits);
+    } else {
+        printf("Crossover at %lu bits. Pass -M %lu to keygen\n", (unsigned long) crossover,
+            (unsigned long) crossover);
+    }
+
+    pmul_shutdown();
+    randstate_clear();
+    return ok ? 0 : EXIT_FAILURE;
+}
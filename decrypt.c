@@ -1,25 +1,116 @@
+#include "batch.h"
 #include "numtheory.h"
+#include "randstate.h"
 #include "rsa.h"
+#include "shard.h"
 
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
-gmp_randstate_t state;
+// Key material handed to each batch mode worker
+typedef struct {
+    mpz_ptr n;
+    mpz_ptr d;
+    rsa_crt_t *crt;
+} dec_ctx_t;
+
+// Decrypts <infile>.<i> into <outfile>.<i>, for i below count, as one
+// batch. File i must have been encrypted with <pub_key_file>.<i> of a key
+// set made by keygen -E from this private key. The exponents of that set
+// are derived from the primes again, the same way keygen picked them.
+//
+// Input parameters:
+// infile: char *: Prefix of the ciphertext files
+// outfile: char *: Prefix of the plaintext files
+// count: uint32_t: Number of files
+// n: mpz_t: Modulus
+// crt: rsa_crt_t *: Prime factors of n
+// Returns: bool: True in case of success
+bool decrypt_batch(char *infile, char *outfile, uint32_t count, mpz_t n, rsa_crt_t *crt) {
+    FILE *ifps[RSA_MAX_BATCH_KEYS], *ofps[RSA_MAX_BATCH_KEYS];
+    char path[PATH_MAX];
+    mpz_t e[RSA_MAX_BATCH_KEYS];
+    uint32_t opened = 0;
+    bool ok = true;
+
+    for (; ok && opened < count; opened++) {
+        snprintf(path, sizeof(path), "%s.%u", infile, opened);
+        if ((ifps[opened] = fopen(path, "r")) == NULL) {
+            printf("Could not open %s\n", path);
+            ok = false;
+            break;
+        }
+        snprintf(path, sizeof(path), "%s.%u", outfile, opened);
+        if ((ofps[opened] = fopen(path, "w")) == NULL) {
+            printf("Could not create %s\n", path);
+            fclose(ifps[opened]);
+            ok = false;
+            break;
+        }
+    }
+
+    if (ok) {
+        for (uint32_t i = 0; i < count; i++) {
+            mpz_init(e[i]);
+        }
+        rsa_make_batch_exponents(e, count, crt->p, crt->count);
+        ok = rsa_decrypt_file_batch(ifps, ofps, e, count, n, crt);
+        for (uint32_t i = 0; i < count; i++) {
+            mpz_clear(e[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < opened; i++) {
+        fclose(ifps[i]);
+        fclose(ofps[i]);
+    }
+    return ok;
+}
 
 // Usage Function
 // Input parameters:
 // exec_name: char *: Name of the program
 // Returns: void
 void usage(char *exec_name) {
-    printf("USAGE: %s [-i <input_file>][-o <output_file>][-n <priv_key_file>][-vh]\n", exec_name);
+    printf("USAGE: %s [-i <input_file>][-o <output_file>][-n <priv_key_file>][-r <input_dir>][-t "
+           "<threads>][-m <cache_mib>][-E <num_keys>][--shard <index>][--merge][-vh]\n",
+        exec_name);
     printf("-i <input_file>: Input file to decrypt. Default is stdin\n");
     printf("-o <output_file>: Output file to decrypt. Default is stdout\n");
     printf("-n <priv_key_file>: File containing the private key. Default is rsa.priv\n");
+    printf("-r <input_dir>: Decrypt every file under input_dir into the directory given by -o\n");
+    printf("-t <threads>: Number of worker threads for -r. Default is the number of CPUs\n");
+    printf("-E <num_keys>: Decrypt <input_file>.<i>, encrypted with <pub_key_file>.<i> of the "
+           "key set keygen -E made with this private key, into <output_file>.<i>, for i below "
+           "num_keys, with batch RSA. At most %d\n",
+        RSA_MAX_BATCH_KEYS);
+    printf("--shard <index>: Decrypt one shard of the sharded ciphertext whose manifest is given "
+           "by -i, writing it at its offset in the file given by -o\n");
+    printf("--merge: Decrypt every shard of the sharded ciphertext whose manifest is given by -i "
+           "into the file given by -o\n");
+    printf("-m <cache_mib>: Memoize repeated blocks in a cache of up to cache_mib MiB per file. "
+           "Default is 0 (off)\n");
     printf("-v: Turn on verbose mode\n");
     printf("-h: Print this message\n");
     return;
 }
 
+// Batch mode callback. Decrypts one file using the key held in ctx.
+//
+// Input parameters:
+// infile: FILE *: Input file containing the ciphertext
+// outfile: FILE *: Output file that will contain the plain text
+// ctx: void *: dec_ctx_t * holding the private key
+// Returns: bool: True in case of success
+bool decrypt_one(FILE *infile, FILE *outfile, void *ctx) {
+    dec_ctx_t *key = ctx;
+    return rsa_decrypt_file_crt(infile, outfile, key->n, key->d, key->crt);
+}
+
 // The main function
 //
 // Input parameters:
@@ -30,40 +121,146 @@ int main(int argc, char **argv) {
     int opt;
     char *infile = NULL;
     char *outfile = NULL;
+    char *indir = NULL;
+    uint32_t nthreads = batch_default_threads();
     char *priv_key_file = "rsa.priv";
     FILE *ifp, *ofp, *pkfp;
     bool verbose = false;
     mpz_t n, d;
+    rsa_crt_t crt;
+    bool merge = false;
+    bool have_shard = false;
+    uint32_t shard = 0;
+    unsigned long value;
+    char *end;
+    uint32_t nbatch = 0;
+    static struct option long_options[] = {
+        { "shard", required_argument, NULL, 'S' },
+        { "merge", no_argument, NULL, 'M' },
+        { NULL, 0, NULL, 0 },
+    };
 
     // Parse the input options.
-    while ((opt = getopt(argc, argv, "vn:i:o:h")) != -1) {
+    while ((opt = getopt_long(argc, argv, "vn:i:o:r:t:m:E:h", long_options, NULL)) != -1) {
         switch (opt) {
         case ('n'): priv_key_file = optarg; break;
         case ('i'): infile = optarg; break;
         case ('o'): outfile = optarg; break;
+        case ('r'): indir = optarg; break;
+        case ('t'): nthreads = strtoul(optarg, NULL, 10); break;
+        case ('m'): rsa_block_cache_bytes = strtoul(optarg, NULL, 10) << 20; break;
+        case ('E'): nbatch = strtoul(optarg, NULL, 10); break;
+        case ('S'):
+            // The index must be a plain decimal number that fits a uint32_t.
+            // strtoul would accept a sign or leading blanks, so the first
+            // character is checked by hand.
+            errno = 0;
+            value = strtoul(optarg, &end, 10);
+            if (optarg[0] < '0' || optarg[0] > '9' || *end != '\0' || errno != 0
+                || value > UINT32_MAX) {
+                printf("Invalid shard index %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            shard = value;
+            have_shard = true;
+            break;
+        case ('M'): merge = true; break;
         case ('v'): verbose = true; break;
         case ('h'): usage(argv[0]); return 0;
         default: usage(argv[0]); exit(EXIT_FAILURE);
         }
     }
 
+    if ((have_shard || merge) && (indir != NULL || infile == NULL || outfile == NULL)) {
+        printf("--shard and --merge require the manifest with -i and the output file with -o\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (nbatch > 0 && (indir != NULL || infile == NULL || outfile == NULL)) {
+        printf("-E requires the input prefix with -i and the output prefix with -o\n");
+        exit(EXIT_FAILURE);
+    }
+    if (nbatch > RSA_MAX_BATCH_KEYS) {
+        printf("The number of batch keys must be at most %d\n", RSA_MAX_BATCH_KEYS);
+        exit(EXIT_FAILURE);
+    }
+
     if ((pkfp = fopen(priv_key_file, "r")) == NULL) {
         printf("The private key file is invalid. Please provide a valid input file\n");
         exit(EXIT_FAILURE);
     }
     mpz_inits(n, d, NULL);
+    rsa_crt_init(&crt);
     rsa_read_priv(n, d, pkfp);
+
+    // Keys made by older versions of keygen have no primes. Those are
+    // decrypted with d directly, as are keys whose primes fail the check.
+    // The random stream is only needed for the primality test of the
+    // primes.
+    randstate_init(time(NULL) ^ ((uint64_t) getpid() << 32));
+    rsa_read_priv_primes(&crt, n, d, pkfp);
+    randstate_clear();
     fclose(pkfp);
 
     if (verbose == true) {
         gmp_printf("n (%ld bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("d (%ld bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
+        for (uint32_t i = 0; i < crt.count; i++) {
+            gmp_printf("p%u (%ld bits) = %Zd\n", i + 1, mpz_sizeinbase(crt.p[i], 2), crt.p[i]);
+        }
+    }
+
+    // Batch mode: the key is read once above and shared by every worker.
+    if (indir != NULL) {
+        if (outfile == NULL) {
+            mpz_clears(n, d, NULL);
+            rsa_crt_clear(&crt);
+            printf("Batch mode requires an output directory. Please provide one with -o\n");
+            exit(EXIT_FAILURE);
+        }
+        dec_ctx_t ctx = { n, d, &crt };
+        int failed = batch_run(indir, outfile, decrypt_one, &ctx, nthreads, verbose);
+        mpz_clears(n, d, NULL);
+        rsa_crt_clear(&crt);
+        if (verbose) {
+            rsa_block_cache_report();
+        }
+        return failed == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    // Batch RSA mode: one full size exponentiation per round of blocks,
+    // instead of one per block.
+    if (nbatch > 0) {
+        bool ok = crt.count > 0;
+        if (!ok) {
+            printf("-E requires a private key that lists its primes\n");
+        }
+        ok = ok && decrypt_batch(infile, outfile, nbatch, n, &crt);
+        mpz_clears(n, d, NULL);
+        rsa_crt_clear(&crt);
+        return ok ? 0 : EXIT_FAILURE;
+    }
+
+    // Sharded mode: shards are decrypted by decrypt_one, like files in batch
+    // mode, and written straight to their place in the output.
+    if (have_shard || merge) {
+        dec_ctx_t ctx = { n, d, &crt };
+        bool ok = merge ? shard_merge(infile, outfile, decrypt_one, &ctx, nthreads)
+                        : shard_decrypt(infile, shard, outfile, decrypt_one, &ctx);
+        mpz_clears(n, d, NULL);
+        rsa_crt_clear(&crt);
+        if (verbose) {
+            rsa_block_cache_report();
+        }
+        return ok ? 0 : EXIT_FAILURE;
     }
 
     if (infile == NULL) {
         ifp = stdin;
     } else if ((ifp = fopen(infile, "r")) == NULL) {
         mpz_clears(n, d, NULL);
+        rsa_crt_clear(&crt);
         printf("The input file is invalid. Please provide a valid input file\n");
         exit(EXIT_FAILURE);
     }
@@ -72,18 +269,23 @@ int main(int argc, char **argv) {
         ofp = stdout;
     } else if ((ofp = fopen(outfile, "w")) == NULL) {
         mpz_clears(n, d, NULL);
+        rsa_crt_clear(&crt);
         printf("The output file is invalid. Please provide a valid output file\n");
         exit(EXIT_FAILURE);
     }
-    rsa_decrypt_file(ifp, ofp, n, d);
+    bool ok = rsa_decrypt_file_crt(ifp, ofp, n, d, &crt);
 
     if (infile != NULL) {
         fclose(ifp);
     }
     if (outfile != NULL) {
-        fclose(ofp);
+        ok = fclose(ofp) == 0 && ok;
     }
     mpz_clears(n, d, NULL);
+    rsa_crt_clear(&crt);
 
-    return 0;
+    if (verbose) {
+        rsa_block_cache_report();
+    }
+    return ok ? 0 : EXIT_FAILURE;
 }
@@ -1,61 +1,96 @@
+#include "batch.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "shard.h"
+#include "vcache.h"
 
+#include <getopt.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-gmp_randstate_t state;
+// Largest number of public keys, and hence recipients, given with -n
+#define MAX_KEYS 16
+
+// Key material handed to each batch mode worker
+typedef struct {
+    mpz_ptr n;
+    mpz_ptr e;
+    bool compress;
+} enc_ctx_t;
 
 // Usage Function
 // Input parameters:
 // exec_name: char *: Name of the program
 // Returns: void
 void usage(char *exec_name) {
-    printf("USAGE: %s [-i <input_file>][-o <output_file>][-n <priv_key_file>][-vh]\n", exec_name);
+    printf("USAGE: %s [-i <input_file>][-o <output_file>][-n <priv_key_file>][-r <input_dir>][-t "
+           "<threads>][-m <cache_mib>][--shards <count>][-fzvh]\n",
+        exec_name);
     printf("-i <input_file>: Input file to decrypt. Default is stdin\n");
     printf("-o <output_file>: Output file to decrypt. Default is stdout\n");
-    printf("-n <pub_key_file>: File containing the public key. Default is rsa.pub\n");
+    printf("-n <pub_key_file>: File containing the public key. Default is rsa.pub. May be "
+           "repeated, up to %d times, to encrypt for several recipients into "
+           "<output_file>.<i>\n",
+        MAX_KEYS);
+    printf("-r <input_dir>: Encrypt every file under input_dir into the directory given by -o\n");
+    printf("-t <threads>: Number of worker threads for -r. Default is the number of CPUs\n");
+    printf("--shards <count>: Split the ciphertext into <count> shards, <output_file>.<i>, "
+           "that can be decrypted independently, plus <output_file>.manifest\n");
+    printf("-f: Always verify the key signature, ignoring the verification cache\n");
+    printf("-z: Compress the input before encrypting it\n");
+    printf("-m <cache_mib>: Memoize repeated blocks in a cache of up to cache_mib MiB per file. "
+           "Default is 0 (off)\n");
     printf("-v: Turn on verbose mode\n");
     printf("-h: Print this message\n");
     return;
 }
 
-// The main function
+// Batch mode callback. Encrypts one file using the key held in ctx.
 //
 // Input parameters:
-// argc: int: Number of input arguments
-// argv: char **: The input arguments
-// Returns: int: 0 in case of success, non-zero for failure
-int main(int argc, char **argv) {
-    int opt;
-    char *infile = NULL;
-    char *outfile = NULL;
-    char *pub_key_file = "rsa.pub";
-    FILE *ifp, *ofp, *pkfp;
-    bool verbose = false;
-    mpz_t m, n, e, s;
-    char user_name[100];
-
-    // Parse the input options.
-    while ((opt = getopt(argc, argv, "vn:i:o:h")) != -1) {
-        switch (opt) {
-        case ('i'): infile = optarg; break;
-        case ('o'): outfile = optarg; break;
-        case ('n'): pub_key_file = optarg; break;
-        case ('v'): verbose = true; break;
-        case ('h'): usage(argv[0]); return 0;
-        default: usage(argv[0]); exit(EXIT_FAILURE);
-        }
+// infile: FILE *: Input file to be encrypted
+// outfile: FILE *: Encrypted output file
+// ctx: void *: enc_ctx_t * holding the public key
+// Returns: bool: True in case of success
+bool encrypt_one(FILE *infile, FILE *outfile, void *ctx) {
+    enc_ctx_t *key = ctx;
+    if (key->compress) {
+        return rsa_encrypt_file_lz(infile, outfile, key->n, key->e);
     }
+    return rsa_encrypt_file(infile, outfile, key->n, key->e);
+}
+
+// Reads a public key and verifies its signature, exiting on failure.
+//
+// Input parameters:
+// pub_key_file: char *: File containing the public key
+// n: mpz_t: Modulus
+// e: mpz_t: Exponent
+// force_verify: bool: Verify the signature even if the cache says it was
+// verified before
+// verbose: bool: Print the key
+// Returns: void
+void read_key(char *pub_key_file, mpz_t n, mpz_t e, bool force_verify, bool verbose) {
+    FILE *pkfp;
+    bool cached = false;
+    struct stat pkst;
+    mpz_t m, s;
+    char user_name[100];
 
     if ((pkfp = fopen(pub_key_file, "r")) == NULL) {
         printf("The public key file is invalid. Please provide a valid input file\n");
         exit(EXIT_FAILURE);
     }
 
-    mpz_inits(m, n, e, s, NULL);
+    mpz_inits(m, s, NULL);
     // mpz_init(m);
     rsa_read_pub(n, e, s, user_name, pkfp);
+    // The status of the key file is taken from the open stream, so that it
+    // describes the file that was actually read.
+    if (fstat(fileno(pkfp), &pkst) != 0) {
+        force_verify = true;
+    }
     fclose(pkfp);
 
     if (verbose == true) {
@@ -74,40 +109,202 @@ int main(int argc, char **argv) {
     // though, as can be seen by the printf output.
     mpz_set_str(m, user_name, 62);
 
-    // Verify the signature using rsa_verify()
-    if (!rsa_verify(m, s, e, n)) {
-        mpz_clears(m, n, e, s, NULL);
-        printf("Signature could not be verified. Exiting...\n");
+    // Verify the signature using rsa_verify(), unless this key file has
+    // already been verified.
+    if (!force_verify) {
+        cached = vcache_lookup(&pkst, n, e, s, user_name);
+    }
+    if (!cached) {
+        if (!rsa_verify(m, s, e, n)) {
+            mpz_clears(m, s, NULL);
+            printf("Signature could not be verified. Exiting...\n");
+            exit(EXIT_FAILURE);
+        }
+        vcache_insert(&pkst, n, e, s, user_name);
+    } else if (verbose) {
+        printf("Signature verified earlier, skipping verification\n");
+    }
+
+    mpz_clears(m, s, NULL);
+}
+
+// Clears the keys read by main.
+//
+// Input parameters:
+// n: mpz_t[]: Moduli
+// e: mpz_t[]: Exponents
+// count: uint32_t: Number of keys
+// Returns: void
+void clear_keys(mpz_t n[], mpz_t e[], uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_clears(n[i], e[i], NULL);
+    }
+}
+
+// The main function
+//
+// Input parameters:
+// argc: int: Number of input arguments
+// argv: char **: The input arguments
+// Returns: int: 0 in case of success, non-zero for failure
+int main(int argc, char **argv) {
+    int opt;
+    char *infile = NULL;
+    char *outfile = NULL;
+    char *indir = NULL;
+    uint32_t nthreads = batch_default_threads();
+    char *pub_key_files[MAX_KEYS] = { "rsa.pub" };
+    uint32_t nkeys = 0;
+    FILE *ifp, *ofp;
+    FILE *ofps[MAX_KEYS];
+    bool verbose = false;
+    bool compress = false;
+    bool force_verify = false;
+    uint32_t nshards = 0;
+    mpz_t n[MAX_KEYS], e[MAX_KEYS];
+    static struct option long_options[] = {
+        { "shards", required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    // Parse the input options.
+    while ((opt = getopt_long(argc, argv, "vn:i:o:r:t:m:fzh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case ('i'): infile = optarg; break;
+        case ('o'): outfile = optarg; break;
+        case ('n'):
+            if (nkeys == MAX_KEYS) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            pub_key_files[nkeys++] = optarg;
+            break;
+        case ('r'): indir = optarg; break;
+        case ('t'): nthreads = strtoul(optarg, NULL, 10); break;
+        case ('m'): rsa_block_cache_bytes = strtoul(optarg, NULL, 10) << 20; break;
+        case ('S'):
+            nshards = strtoul(optarg, NULL, 10);
+            if (nshards == 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case ('f'): force_verify = true; break;
+        case ('z'): compress = true; break;
+        case ('v'): verbose = true; break;
+        case ('h'): usage(argv[0]); return 0;
+        default: usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+
+    if (nkeys == 0) {
+        nkeys = 1;
+    }
+    if (nkeys > 1 && (indir != NULL || outfile == NULL)) {
+        printf("Several public keys require -o, and cannot be combined with -r\n");
         exit(EXIT_FAILURE);
     }
+    if (nshards > 0 && (nkeys > 1 || indir != NULL || infile == NULL || outfile == NULL)) {
+        printf("Sharding requires -i and -o, and a single public key without -r\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < nkeys; i++) {
+        mpz_inits(n[i], e[i], NULL);
+        read_key(pub_key_files[i], n[i], e[i], force_verify, verbose);
+    }
+
+    // Batch mode: the key has been read and verified once above, and is now
+    // shared by every worker.
+    if (indir != NULL) {
+        if (outfile == NULL) {
+            clear_keys(n, e, nkeys);
+            printf("Batch mode requires an output directory. Please provide one with -o\n");
+            exit(EXIT_FAILURE);
+        }
+        enc_ctx_t ctx = { n[0], e[0], compress };
+        int failed = batch_run(indir, outfile, encrypt_one, &ctx, nthreads, verbose);
+        clear_keys(n, e, nkeys);
+        if (verbose) {
+            rsa_block_cache_report();
+        }
+        return failed == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    // Sharded mode: each shard is a range of whole blocks, encrypted by
+    // encrypt_one just like a file in batch mode.
+    if (nshards > 0) {
+        enc_ctx_t ctx = { n[0], e[0], compress };
+        uint64_t k = (mpz_sizeinbase(n[0], 2) - 1) / 8;
+        bool ok
+            = shard_encrypt(infile, outfile, nshards, k - 1, encrypt_one, &ctx, nthreads, verbose);
+        clear_keys(n, e, nkeys);
+        if (verbose) {
+            rsa_block_cache_report();
+        }
+        return ok ? 0 : EXIT_FAILURE;
+    }
 
     if (infile == NULL) {
         ifp = stdin;
     } else if ((ifp = fopen(infile, "r")) == NULL) {
-        mpz_clears(m, n, e, s, NULL);
+        clear_keys(n, e, nkeys);
         printf("The input file is invalid. Please provide a valid input file\n");
         exit(EXIT_FAILURE);
     }
 
+    // Several recipients: the input is read once, and the ciphertext for
+    // the i-th key is written to <output_file>.<i>.
+    if (nkeys > 1) {
+        char path[PATH_MAX];
+        for (uint32_t i = 0; i < nkeys; i++) {
+            int len = snprintf(path, sizeof(path), "%s.%u", outfile, i);
+            if (len < 0 || (size_t) len >= sizeof(path) || (ofps[i] = fopen(path, "w")) == NULL) {
+                clear_keys(n, e, nkeys);
+                printf("The output file is invalid. Please provide a valid output file\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        bool ok = compress ? rsa_encrypt_file_multi_lz(ifp, ofps, n, e, nkeys)
+                           : rsa_encrypt_file_multi(ifp, ofps, n, e, nkeys);
+
+        for (uint32_t i = 0; i < nkeys; i++) {
+            ok = fclose(ofps[i]) == 0 && ok;
+        }
+        clear_keys(n, e, nkeys);
+        if (infile != NULL) {
+            fclose(ifp);
+        }
+        if (verbose) {
+            rsa_block_cache_report();
+        }
+        return ok ? 0 : EXIT_FAILURE;
+    }
+
     if (outfile == NULL) {
         ofp = stdout;
     } else if ((ofp = fopen(outfile, "w")) == NULL) {
-        mpz_clears(m, n, e, s, NULL);
+        clear_keys(n, e, nkeys);
         printf("The output file is invalid. Please provide a valid output file\n");
         exit(EXIT_FAILURE);
     }
 
-    rsa_encrypt_file(ifp, ofp, n, e);
+    bool ok = compress ? rsa_encrypt_file_lz(ifp, ofp, n[0], e[0])
+                       : rsa_encrypt_file(ifp, ofp, n[0], e[0]);
 
     // Clear any mpz_t variables
-    mpz_clears(m, n, e, s, NULL);
+    clear_keys(n, e, nkeys);
 
     if (infile != NULL) {
         fclose(ifp);
     }
     if (outfile != NULL) {
-        fclose(ofp);
+        ok = fclose(ofp) == 0 && ok;
     }
 
-    return 0;
+    if (verbose) {
+        rsa_block_cache_report();
+    }
+    return ok ? 0 : EXIT_FAILURE;
 }
@@ -0,0 +1,355 @@
+#include "hex.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Hex conversion for the text key and ciphertext formats. The output is the
+// same as gmp's "%Zx" (lower case, no leading zeros), but the conversion
+// goes straight between hex text and the limbs of an mpz_t, without gmp's
+// generic radix conversion. On x86-64 the bulk of the work is done 16
+// (SSE2) or 32 (AVX2, when the CPU has it) bytes at a time.
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HEX_X86 1
+#include <immintrin.h>
+#endif
+
+#define LIMB_BYTES sizeof(mp_limb_t)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Line and byte buffers kept by hex_read_mpz between calls, one set per
+// thread, so that reading a file of blocks does not allocate for every
+// line. They grow to the longest line read and are freed when the thread
+// exits.
+typedef struct {
+    char *line;
+    size_t line_cap;
+    uint8_t *bytes;
+    size_t bytes_cap;
+} hex_buf_t;
+
+static pthread_key_t hex_buf_key;
+static pthread_once_t hex_buf_once = PTHREAD_ONCE_INIT;
+
+static void hex_buf_free(void *arg) {
+    hex_buf_t *buf = arg;
+    free(buf->line);
+    free(buf->bytes);
+    free(buf);
+}
+
+static void hex_buf_key_init(void) {
+    pthread_key_create(&hex_buf_key, hex_buf_free);
+}
+
+// Returns the calling thread's buffers, creating them on first use.
+static hex_buf_t *hex_buf_get(void) {
+    hex_buf_t *buf;
+
+    pthread_once(&hex_buf_once, hex_buf_key_init);
+    if ((buf = pthread_getspecific(hex_buf_key)) == NULL) {
+        buf = (hex_buf_t *) calloc(1, sizeof(hex_buf_t));
+        pthread_setspecific(hex_buf_key, buf);
+    }
+    return buf;
+}
+
+static void hex_encode_scalar(char *dst, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[2 * i] = hex_digits[src[i] >> 4];
+        dst[2 * i + 1] = hex_digits[src[i] & 0xF];
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static bool hex_decode_scalar(uint8_t *dst, const char *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int hi = hex_value(src[2 * i]), lo = hex_value(src[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        dst[i] = (uint8_t) ((hi << 4) | lo);
+    }
+    return true;
+}
+
+#ifdef HEX_X86
+// Nibbles (0-15 in each byte) to ASCII: '0' + x, plus 39 more for x > 9.
+static inline __m128i hex_ascii_sse2(__m128i x) {
+    __m128i gt9 = _mm_cmpgt_epi8(x, _mm_set1_epi8(9));
+    return _mm_add_epi8(_mm_add_epi8(x, _mm_set1_epi8('0')), _mm_and_si128(gt9, _mm_set1_epi8(39)));
+}
+
+// ASCII to nibbles. Lanes that are not hex digits are cleared in *valid.
+static inline __m128i hex_nibbles_sse2(__m128i c, __m128i *valid) {
+    __m128i lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i digit = _mm_and_si128(
+        _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i alpha = _mm_and_si128(
+        _mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lc, _mm_set1_epi8('f' + 1)));
+    *valid = _mm_and_si128(*valid, _mm_or_si128(digit, alpha));
+    return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+        _mm_and_si128(alpha, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+}
+
+// Joins each pair of nibbles (first one high) into a byte, in the low byte
+// of every 16-bit lane.
+static inline __m128i hex_join_sse2(__m128i v) {
+    __m128i t = _mm_or_si128(_mm_slli_epi16(v, 4), _mm_srli_epi16(v, 8));
+    return _mm_and_si128(t, _mm_set1_epi16(0xFF));
+}
+
+static size_t hex_encode_sse2(char *dst, const uint8_t *src, size_t n) {
+    __m128i mask = _mm_set1_epi8(0xF);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        __m128i lo = _mm_and_si128(v, mask);
+        _mm_storeu_si128((__m128i *) (dst + 2 * i), hex_ascii_sse2(_mm_unpacklo_epi8(hi, lo)));
+        _mm_storeu_si128((__m128i *) (dst + 2 * i + 16), hex_ascii_sse2(_mm_unpackhi_epi8(hi, lo)));
+    }
+    return i;
+}
+
+static size_t hex_decode_sse2(uint8_t *dst, const char *src, size_t n, bool *ok) {
+    __m128i valid = _mm_set1_epi8(-1);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i a = hex_nibbles_sse2(_mm_loadu_si128((const __m128i *) (src + 2 * i)), &valid);
+        __m128i b = hex_nibbles_sse2(_mm_loadu_si128((const __m128i *) (src + 2 * i + 16)), &valid);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(hex_join_sse2(a), hex_join_sse2(b)));
+    }
+    *ok = _mm_movemask_epi8(valid) == 0xFFFF;
+    return i;
+}
+
+#define HEX_AVX2 __attribute__((target("avx2")))
+
+HEX_AVX2 static inline __m256i hex_ascii_avx2(__m256i x) {
+    __m256i gt9 = _mm256_cmpgt_epi8(x, _mm256_set1_epi8(9));
+    return _mm256_add_epi8(
+        _mm256_add_epi8(x, _mm256_set1_epi8('0')), _mm256_and_si256(gt9, _mm256_set1_epi8(39)));
+}
+
+HEX_AVX2 static inline __m256i hex_nibbles_avx2(__m256i c, __m256i *valid) {
+    __m256i lc = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('9')),
+        _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)));
+    __m256i alpha = _mm256_andnot_si256(_mm256_cmpgt_epi8(lc, _mm256_set1_epi8('f')),
+        _mm256_cmpgt_epi8(lc, _mm256_set1_epi8('a' - 1)));
+    *valid = _mm256_and_si256(*valid, _mm256_or_si256(digit, alpha));
+    return _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+        _mm256_and_si256(alpha, _mm256_sub_epi8(lc, _mm256_set1_epi8('a' - 10))));
+}
+
+HEX_AVX2 static inline __m256i hex_join_avx2(__m256i v) {
+    __m256i t = _mm256_or_si256(_mm256_slli_epi16(v, 4), _mm256_srli_epi16(v, 8));
+    return _mm256_and_si256(t, _mm256_set1_epi16(0xFF));
+}
+
+HEX_AVX2 static size_t hex_encode_avx2(char *dst, const uint8_t *src, size_t n) {
+    __m256i mask = _mm256_set1_epi8(0xF);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+        __m256i lo = _mm256_and_si256(v, mask);
+
+        // unpack works within 128-bit lanes, so the halves come out as
+        // (bytes 0-7, 16-23) and (8-15, 24-31), and are put back in order.
+        __m256i a = hex_ascii_avx2(_mm256_unpacklo_epi8(hi, lo));
+        __m256i b = hex_ascii_avx2(_mm256_unpackhi_epi8(hi, lo));
+        _mm256_storeu_si256((__m256i *) (dst + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return i;
+}
+
+HEX_AVX2 static size_t hex_decode_avx2(uint8_t *dst, const char *src, size_t n, bool *ok) {
+    __m256i valid = _mm256_set1_epi8(-1);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i a = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *) (src + 2 * i)), &valid);
+        __m256i b
+            = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *) (src + 2 * i + 32)), &valid);
+
+        // pack also works within lanes; restore the order of the 8 byte groups.
+        __m256i v = _mm256_packus_epi16(hex_join_avx2(a), hex_join_avx2(b));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_permute4x64_epi64(v, 0xD8));
+    }
+    *ok = _mm256_movemask_epi8(valid) == -1;
+    return i;
+}
+#endif
+
+// Converts n bytes to 2n lower case hex digits. No terminator is written.
+//
+// Input parameters:
+// dst: char *: Output buffer of at least 2n characters
+// src: const uint8_t *: Bytes to convert
+// n: size_t: Number of bytes
+// Returns: size_t: Number of characters written
+size_t hex_encode(char *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+#ifdef HEX_X86
+    if (__builtin_cpu_supports("avx2")) {
+        i = hex_encode_avx2(dst, src, n);
+    }
+    i += hex_encode_sse2(dst + 2 * i, src + i, n - i);
+#endif
+    hex_encode_scalar(dst + 2 * i, src + i, n - i);
+    return 2 * n;
+}
+
+// Converts 2n hex digits (upper or lower case) to n bytes.
+//
+// Input parameters:
+// dst: uint8_t *: Output buffer of at least n bytes
+// src: const char *: Hex digits to convert
+// n: size_t: Number of bytes to produce
+// Returns: bool: True in case of success, false if src has a non-hex digit
+bool hex_decode(uint8_t *dst, const char *src, size_t n) {
+    bool ok = true, lane_ok;
+    size_t i = 0;
+#ifdef HEX_X86
+    if (__builtin_cpu_supports("avx2")) {
+        i = hex_decode_avx2(dst, src, n, &lane_ok);
+        ok = lane_ok;
+    }
+    i += hex_decode_sse2(dst + i, src + 2 * i, n - i, &lane_ok);
+    ok = ok && lane_ok;
+#endif
+    (void) lane_ok;
+    return hex_decode_scalar(dst + i, src + 2 * i, n - i) && ok;
+}
+
+// Writes z to outfile as a hexstring followed by a newline, as
+// gmp_fprintf(outfile, "%Zx\n", z) would. z must not be negative.
+//
+// Input parameters:
+// outfile: FILE *: Output file
+// z: mpz_t: Number to write
+// Returns: void
+void hex_write_mpz(FILE *outfile, mpz_t z) {
+    size_t nl = mpz_size(z), nb = nl * LIMB_BYTES, skip = 0;
+    const mp_limb_t *lp = mpz_limbs_read(z);
+    uint8_t *bytes;
+    char *txt;
+
+    if (nl == 0) {
+        fputs("0\n", outfile);
+        return;
+    }
+
+    bytes = (uint8_t *) malloc(nb);
+    txt = (char *) malloc(2 * nb + 1);
+
+    // Limbs are stored least significant first; lay them out big endian.
+    for (size_t i = 0; i < nl; i++) {
+        mp_limb_t l = lp[nl - 1 - i];
+        for (size_t b = 0; b < LIMB_BYTES; b++) {
+            bytes[i * LIMB_BYTES + b] = (uint8_t) (l >> (8 * (LIMB_BYTES - 1 - b)));
+        }
+    }
+    hex_encode(txt, bytes, nb);
+
+    // The top limb is non-zero, so only its leading zeros need stripping.
+    while (txt[skip] == '0') {
+        skip++;
+    }
+    txt[2 * nb] = '\n';
+    fwrite(txt + skip, 1, 2 * nb + 1 - skip, outfile);
+
+    free(bytes);
+    free(txt);
+}
+
+// Reads the next hexstring from infile into z. Hexstrings are one per line,
+// as written by hex_write_mpz; blank lines are skipped. The line is read
+// in one go, into a buffer that is reused by later calls from the same
+// thread, and converted in bulk.
+//
+// Input parameters:
+// infile: FILE *: Input file
+// z: mpz_t: The number read is stored here
+// Returns: bool: True if a number was read. False at the end of the file,
+// or if the next line is not a hexstring.
+bool hex_read_mpz(FILE *infile, mpz_t z) {
+    hex_buf_t *buf = hex_buf_get();
+    char *p, *end;
+    size_t len, nb, nl;
+    uint8_t *bytes;
+    mp_limb_t *lp;
+    ssize_t got;
+    bool ok = false;
+
+    while ((got = getline(&buf->line, &buf->line_cap, infile)) > 0) {
+        p = buf->line;
+        end = buf->line + got;
+        while (p < end && isspace((unsigned char) *p)) {
+            p++;
+        }
+        while (end > p && isspace((unsigned char) end[-1])) {
+            end--;
+        }
+        if (p == end) {
+            continue;
+        }
+
+        // An odd number of digits gets a leading zero nibble.
+        len = end - p;
+        nb = (len + 1) / 2;
+        if (nb > buf->bytes_cap) {
+            if ((bytes = (uint8_t *) realloc(buf->bytes, nb)) == NULL) {
+                break;
+            }
+            buf->bytes = bytes;
+            buf->bytes_cap = nb;
+        }
+        bytes = buf->bytes;
+        if (len % 2) {
+            int v = hex_value(*p++);
+            bytes[0] = (uint8_t) v;
+            ok = v >= 0 && hex_decode(bytes + 1, p, nb - 1);
+        } else {
+            ok = hex_decode(bytes, p, nb);
+        }
+
+        if (ok) {
+            nl = (nb + LIMB_BYTES - 1) / LIMB_BYTES;
+            lp = mpz_limbs_write(z, nl);
+            for (size_t i = 0; i < nl; i++) {
+                // Limb i holds the bytes ending i limbs from the end.
+                size_t hi = nb - i * LIMB_BYTES;
+                size_t lo = hi > LIMB_BYTES ? hi - LIMB_BYTES : 0;
+                mp_limb_t l = 0;
+                for (size_t b = lo; b < hi; b++) {
+                    l = (l << 8) | bytes[b];
+                }
+                lp[i] = l;
+            }
+            mpz_limbs_finish(z, nl);
+        }
+        break;
+    }
+
+    return ok;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+size_t hex_encode(char *dst, const uint8_t *src, size_t n);
+
+bool hex_decode(uint8_t *dst, const char *src, size_t n);
+
+void hex_write_mpz(FILE *outfile, mpz_t z);
+
+bool hex_read_mpz(FILE *infile, mpz_t z);
@@ -1,32 +1,114 @@
 #include "numtheory.h"
+#include "pmul.h"
+#include "primepool.h"
 #include "rsa.h"
 #include "randstate.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/stat.h>
 
-gmp_randstate_t state;
-
 // Usage Function
 // Input parameters:
 // exec_name: char *: Name of the program
 // Returns: void
 void usage(char *exec_name) {
     printf("USAGE: %s [-b <num_bits>][-i <num_iters>][-n <pub_key_file>][-d <priv_key_file>][-s "
-           "<seed>][-vh]\n",
+           "<seed>][-P <num_primes>][-p <pool_dir>][-t <threads>][-E <num_keys>][-M <bits>][-vh]\n",
         exec_name);
     printf("-b <num_bits>: Minimum number of bits needed for public modulus n\n");
     printf("-i <num_iters>: Number of Miller-Rabin iterations for testing primes\n");
     printf("-n <pub_key_file>: File containing the public key. Default is rsa.pub\n");
     printf("-d <pub_key_file>: File containing the private key. Default is rsa.priv\n");
     printf("-s <seed>: Seed for random state initialization\n");
+    printf("-P <num_primes>: Number of primes in the modulus, 2 to %d. Default is 2\n",
+        RSA_MAX_PRIMES);
+    printf("-p <pool_dir>: Take the primes from the prime pool in pool_dir when available\n");
+    printf("-t <threads>: Number of threads to search for primes with. Default is the number of "
+           "CPUs\n");
+    printf("-E <num_keys>: Also write num_keys keys, <pub_key_file>.<i> and <priv_key_file>.<i>, "
+           "that share the modulus but have distinct small exponents, for batch decryption. At "
+           "most %d\n",
+        RSA_MAX_BATCH_KEYS);
+    printf("-M <bits>: Split multiplications across the -t threads for numbers of at least bits "
+           "bits. Default is %lu. The bench program measures the best value\n",
+        (unsigned long) pmul_threshold);
     printf("-v: Turn on verbose mode\n");
     printf("-h: Print this message\n");
     return;
 }
 
+// Writes the keys of a batch set, which share the modulus n and differ only
+// in their exponent, to <pbfile>.<i> and <pvfile>.<i>.
+//
+// Input parameters:
+// pbfile: char *: Name of the public key file
+// pvfile: char *: Name of the private key file
+// count: uint32_t: Number of keys
+// n: mpz_t: Modulus
+// primes: mpz_t[]: Prime factors of n
+// nprimes: uint32_t: Number of primes
+// user_name: char *: Name signed in each public key
+// verbose: bool: Print the exponents
+// Returns: bool: True in case of success
+bool write_batch_keys(char *pbfile, char *pvfile, uint32_t count, mpz_t n, mpz_t primes[],
+    uint32_t nprimes, char *user_name, bool verbose) {
+    char path[PATH_MAX];
+    mpz_t e[RSA_MAX_BATCH_KEYS];
+    mpz_t d, s, u;
+    rsa_crt_t crt;
+    FILE *fp;
+    bool ok = true;
+
+    mpz_inits(d, s, u, NULL);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_init(e[i]);
+    }
+    rsa_crt_init(&crt);
+    mpz_set_str(u, user_name, 62);
+
+    rsa_make_batch_exponents(e, count, primes, nprimes);
+    for (uint32_t i = 0; i < count; i++) {
+        rsa_make_priv_multi(d, e[i], primes, nprimes);
+
+        snprintf(path, sizeof(path), "%s.%u", pvfile, i);
+        if ((fp = fopen(path, "w")) == NULL) {
+            printf("Could not create %s\n", path);
+            ok = false;
+            break;
+        }
+        fchmod(fileno(fp), S_IRUSR | S_IWUSR);
+        rsa_write_priv(n, d, fp);
+        rsa_write_priv_primes(primes, nprimes, fp);
+        fclose(fp);
+
+        rsa_crt_set(&crt, primes, nprimes, d);
+        rsa_sign_crt(s, u, &crt);
+
+        snprintf(path, sizeof(path), "%s.%u", pbfile, i);
+        if ((fp = fopen(path, "w")) == NULL) {
+            printf("Could not create %s\n", path);
+            ok = false;
+            break;
+        }
+        rsa_write_pub(n, e[i], s, user_name, fp);
+        fclose(fp);
+
+        if (verbose == true) {
+            gmp_printf("e%u = %Zd\n", i, e[i]);
+        }
+    }
+
+    rsa_crt_clear(&crt);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_clear(e[i]);
+    }
+    mpz_clears(d, s, u, NULL);
+    return ok;
+}
+
 // The main function
 //
 // Input parameters:
@@ -37,28 +119,55 @@ int main(int argc, char **argv) {
     int opt;
     uint64_t nbits = 256;
     uint32_t mr_iters = 50;
+    uint32_t nprimes = 2;
+    uint32_t pooled = 0;
+    uint32_t nbatch = 0;
+    uint32_t nthreads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    char *pool_dir = NULL;
     char *pbfile = "rsa.pub";
     char *pvfile = "rsa.priv";
     FILE *pbfp, *pvfp;
     time_t seed = time(NULL);
     bool verbose = false;
     char *user_name;
-    mpz_t d, e, m, n, p, q, s, u;
+    mpz_t d, e, m, n, s, u;
+    mpz_t primes[RSA_MAX_PRIMES];
+    rsa_crt_t crt;
 
     // Parse the input options.
-    while ((opt = getopt(argc, argv, "b:vi:n:d:s:h")) != -1) {
+    while ((opt = getopt(argc, argv, "b:vi:n:d:s:P:p:t:E:M:h")) != -1) {
         switch (opt) {
         case ('b'): nbits = strtoul(optarg, NULL, 10); break;
         case ('i'): mr_iters = strtoul(optarg, NULL, 10); break;
         case ('n'): pbfile = optarg; break;
         case ('d'): pvfile = optarg; break;
         case ('s'): seed = strtoul(optarg, NULL, 10); break;
+        case ('P'): nprimes = strtoul(optarg, NULL, 10); break;
+        case ('p'): pool_dir = optarg; break;
+        case ('t'): nthreads = strtoul(optarg, NULL, 10); break;
+        case ('E'): nbatch = strtoul(optarg, NULL, 10); break;
+        case ('M'): pmul_threshold = strtoul(optarg, NULL, 10); break;
         case ('v'): verbose = true; break;
         case ('h'): usage(argv[0]); return 0;
         default: usage(argv[0]); exit(EXIT_FAILURE);
         }
     }
 
+    if (nprimes < 2 || nprimes > RSA_MAX_PRIMES) {
+        printf("The number of primes must be between 2 and %d\n", RSA_MAX_PRIMES);
+        exit(EXIT_FAILURE);
+    }
+    if (nbits / nprimes < RSA_MIN_PRIME_BITS) {
+        printf("Each prime must have at least %d bits. Please ask for at least %u bits\n",
+            RSA_MIN_PRIME_BITS, RSA_MIN_PRIME_BITS * nprimes);
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (nbatch > RSA_MAX_BATCH_KEYS) {
+        printf("The number of batch keys must be at most %d\n", RSA_MAX_BATCH_KEYS);
+        exit(EXIT_FAILURE);
+    }
+
     // Open the public key file for writing
     if ((pbfp = fopen(pbfile, "w")) == NULL) {
         printf("The public key file is invalid. Please provide a valid input file\n");
@@ -75,26 +184,59 @@ int main(int argc, char **argv) {
         fchmod(fd, S_IRUSR | S_IWUSR);
     }
 
+    // The multiplication threads only matter for very large keys, with
+    // primes of at least pmul_threshold bits.
     randstate_init(seed);
-    mpz_inits(d, e, m, n, p, q, s, u, NULL);
-    rsa_make_pub(p, q, n, e, nbits, mr_iters);
-    rsa_make_priv(d, e, p, q);
+    if (nbits / nprimes >= pmul_threshold) {
+        pmul_init(nthreads);
+    }
+    mpz_inits(d, e, m, n, s, u, NULL);
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES; i++) {
+        mpz_init(primes[i]);
+    }
+    rsa_crt_init(&crt);
+
+    // Draw what we can from the prime pool. Any prime the pool cannot supply
+    // is left at 0, and is generated by rsa_make_pub_multi.
+    if (pool_dir != NULL) {
+        for (uint32_t i = 0; i < nprimes; i++) {
+            if (primepool_draw(pool_dir, rsa_prime_bits(nbits, nprimes, i), mr_iters, primes[i])) {
+                pooled++;
+            }
+        }
+    }
+
+    if (nprimes == 2 && pool_dir == NULL) {
+        rsa_make_pub(primes[0], primes[1], n, e, nbits, mr_iters, nthreads);
+        rsa_make_priv(d, e, primes[0], primes[1]);
+    } else {
+        rsa_make_pub_multi(primes, nprimes, n, e, nbits, mr_iters, nthreads);
+        rsa_make_priv_multi(d, e, primes, nprimes);
+    }
+
+    // Write the public and private keys. The primes are kept in the private
+    // key so that decrypt can use the CRT.
+    rsa_write_priv(n, d, pvfp);
+    rsa_write_priv_primes(primes, nprimes, pvfp);
 
     user_name = getenv("USER");
     mpz_set_str(u, user_name, 62);
 
     // Compute the signature of the user name
-    rsa_sign(s, u, d, n);
+    rsa_crt_set(&crt, primes, nprimes, d);
+    rsa_sign_crt(s, u, &crt);
 
-    // Write the public and private keys
     rsa_write_pub(n, e, s, user_name, pbfp);
-    rsa_write_priv(n, d, pvfp);
 
     if (verbose == true) {
         printf("user = %s\n", user_name);
+        if (pool_dir != NULL) {
+            printf("%u of %u primes taken from the pool\n", pooled, nprimes);
+        }
         gmp_printf("s (%ld bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
-        gmp_printf("p (%ld bits) = %Zd\n", mpz_sizeinbase(p, 2), p);
-        gmp_printf("q (%ld bits) = %Zd\n", mpz_sizeinbase(q, 2), q);
+        for (uint32_t i = 0; i < nprimes; i++) {
+            gmp_printf("p%u (%ld bits) = %Zd\n", i + 1, mpz_sizeinbase(primes[i], 2), primes[i]);
+        }
         gmp_printf("n (%ld bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("e (%ld bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
         gmp_printf("d (%ld bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
@@ -103,9 +245,18 @@ int main(int argc, char **argv) {
     fclose(pbfp);
     fclose(pvfp);
 
+    // The batch keys reuse the primes of the main key.
+    bool ok = nbatch == 0
+              || write_batch_keys(pbfile, pvfile, nbatch, n, primes, nprimes, user_name, verbose);
+
     // Clear all mpz_t variables
+    pmul_shutdown();
     randstate_clear();
-    mpz_clears(d, e, m, n, p, q, s, u, NULL);
+    mpz_clears(d, e, m, n, s, u, NULL);
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES; i++) {
+        mpz_clear(primes[i]);
+    }
+    rsa_crt_clear(&crt);
 
-    return 0;
+    return ok ? 0 : EXIT_FAILURE;
 }
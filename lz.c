@@ -0,0 +1,253 @@
+#include "lz.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A small LZ77 compressor in the style of LZ4. The compressed data is a list
+// of sequences, each made of a token byte, a run of literals, and a match:
+//
+// token: high nibble = literal count, low nibble = match length - LZ_MIN_MATCH.
+//        A nibble of 15 means the count continues in the following bytes,
+//        each adding up to 255, ending with the first byte below 255.
+// literals: copied verbatim
+// offset: 2 bytes, little endian, distance back to the start of the match
+//
+// The last sequence of a chunk carries literals only and no offset.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
+
+// Worst case size of the compressed form of n bytes.
+//
+// Input parameters:
+// n: size_t: Number of input bytes
+// Returns: size_t: Size of the buffer lz_compress needs for its output
+size_t lz_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length nibble overflow as a run of bytes.
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+// Emits one sequence: lit_len literals starting at lit, followed by a match
+// of match_len bytes at distance offset (or no match if match_len is 0).
+static uint8_t *lz_put_seq(
+    uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *token = (uint8_t) (((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15) {
+        op = lz_put_len(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        if (ml >= 15) {
+            op = lz_put_len(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+// Compresses n bytes (at most LZ_CHUNK) from src into dst.
+//
+// Input parameters:
+// src: const uint8_t *: Data to compress
+// n: size_t: Number of bytes in src
+// dst: uint8_t *: Output buffer of at least lz_bound(n) bytes
+// Returns: size_t: Number of bytes written to dst
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *anchor = src;
+    uint8_t *op = dst;
+    size_t ip = 0;
+
+    memset(table, 0xFF, sizeof(table));
+
+    while (n >= LZ_MIN_MATCH && ip <= n - LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(lz_read32(src + ip));
+        uint32_t ref = table[h];
+        table[h] = (uint32_t) ip;
+
+        if (ref == UINT32_MAX || ip - ref > 0xFFFF
+            || lz_read32(src + ref) != lz_read32(src + ip)) {
+            ip++;
+            continue;
+        }
+
+        // Extend the match as far as it goes.
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len]) {
+            len++;
+        }
+
+        op = lz_put_seq(op, anchor, src + ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = src + ip;
+    }
+
+    return lz_put_seq(op, anchor, src + n - anchor, 0, 0) - dst;
+}
+
+// Reads a length nibble overflow. Returns false if it runs past the input.
+static bool lz_get_len(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompresses n bytes from src into dst, which must decode to exactly
+// out_len bytes. All reads and writes are bounds checked.
+//
+// Input parameters:
+// src: const uint8_t *: Compressed data
+// n: size_t: Number of bytes in src
+// dst: uint8_t *: Output buffer of out_len bytes
+// out_len: size_t: Expected size of the decompressed data
+// Returns: bool: True in case of success, false if the data is corrupt
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out_len) {
+    const uint8_t *ip = src, *end = src + n;
+    size_t op = 0;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        size_t match_len = token & 0xF;
+
+        if (lit_len == 15 && !lz_get_len(&ip, end, &lit_len)) {
+            return false;
+        }
+        if (lit_len > (size_t) (end - ip) || lit_len > out_len - op) {
+            return false;
+        }
+        memcpy(dst + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // The final sequence has no match.
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (match_len == 15 && !lz_get_len(&ip, end, &match_len)) {
+            return false;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > out_len - op) {
+            return false;
+        }
+
+        // Byte by byte, since the match may overlap the bytes it produces.
+        for (size_t i = 0; i < match_len; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op == out_len;
+}
+
+static void lz_put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t lz_get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Compresses infile into outfile as a series of independent chunks of at
+// most LZ_CHUNK bytes. Each chunk is preceded by its original and compressed
+// lengths as 4 byte big endian values. A chunk that does not shrink is
+// stored as is, with both lengths equal.
+//
+// Input parameters:
+// infile: FILE *: Input file to be compressed
+// outfile: FILE *: Compressed output file
+// Returns: bool: True in case of success
+bool lz_compress_file(FILE *infile, FILE *outfile) {
+    uint8_t *raw = (uint8_t *) malloc(LZ_CHUNK);
+    uint8_t *comp = (uint8_t *) malloc(lz_bound(LZ_CHUNK));
+    uint8_t hdr[8];
+    bool ok = true;
+    size_t j, c;
+
+    while (ok && (j = fread(raw, 1, LZ_CHUNK, infile)) > 0) {
+        c = lz_compress(raw, j, comp);
+        lz_put32(hdr, j);
+        lz_put32(hdr + 4, c < j ? c : j);
+        ok = fwrite(hdr, 1, 8, outfile) == 8;
+        if (c < j) {
+            ok = ok && fwrite(comp, 1, c, outfile) == c;
+        } else {
+            ok = ok && fwrite(raw, 1, j, outfile) == j;
+        }
+    }
+
+    free(raw);
+    free(comp);
+    return ok && !ferror(infile);
+}
+
+// Reverses lz_compress_file.
+//
+// Input parameters:
+// infile: FILE *: Compressed input file
+// outfile: FILE *: Decompressed output file
+// Returns: bool: True in case of success, false if the input is corrupt
+bool lz_decompress_file(FILE *infile, FILE *outfile) {
+    uint8_t *raw = (uint8_t *) malloc(LZ_CHUNK);
+    uint8_t *comp = (uint8_t *) malloc(LZ_CHUNK);
+    uint8_t hdr[8];
+    bool ok = true;
+    size_t h = 0, j, c;
+
+    while (ok && (h = fread(hdr, 1, 8, infile)) == 8) {
+        j = lz_get32(hdr);
+        c = lz_get32(hdr + 4);
+        if (j > LZ_CHUNK || c > j || fread(comp, 1, c, infile) != c) {
+            ok = false;
+        } else if (c == j) {
+            ok = fwrite(comp, 1, j, outfile) == j;
+        } else {
+            ok = lz_decompress(comp, c, raw, j) && fwrite(raw, 1, j, outfile) == j;
+        }
+    }
+
+    free(raw);
+    free(comp);
+    return ok && h == 0 && !ferror(infile);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Maximum number of input bytes compressed as one independent chunk
+#define LZ_CHUNK (64 * 1024)
+
+size_t lz_bound(size_t n);
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst);
+
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out_len);
+
+bool lz_compress_file(FILE *infile, FILE *outfile);
+
+bool lz_decompress_file(FILE *infile, FILE *outfile);
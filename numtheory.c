@@ -1,6 +1,10 @@
 #include "numtheory.h"
+#include "pmul.h"
 #include "randstate.h"
 
+#include <pthread.h>
+#include <stdlib.h>
+
 // Calculates the gcd of a and b using Euler's recursive algorithm
 //
 // Input parameters:
@@ -78,6 +82,15 @@ void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
 //
 // Returns: void
 void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
+    // Very large moduli are handed to the parallel multiplication layer.
+    if (pmul_enabled(modulus)) {
+        pmul_mod_t ctx;
+        pmul_mod_init(&ctx, modulus);
+        pmul_pow_mod(&ctx, out, base, exponent);
+        pmul_mod_clear(&ctx);
+        return;
+    }
+
     mpz_t e, v, p, rop;
     mpz_inits(e, v, p, rop, NULL);
     mpz_set_ui(v, 1);
@@ -108,6 +121,23 @@ void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
 bool is_prime(mpz_t n, uint64_t iters) {
     mpz_t y, a, r, n_minus_1, two_mpz;
     uint64_t s;
+    pmul_mod_t ctx;
+
+    // Small and even n are decided directly. The random bases below need
+    // n >= 5.
+    if (mpz_cmp_ui(n, 5) < 0) {
+        return !mpz_cmp_ui(n, 2) || !mpz_cmp_ui(n, 3);
+    }
+    if (mpz_even_p(n)) {
+        return false;
+    }
+
+    // For very large n, the reduction context is set up once for all the
+    // exponentiations and squarings below.
+    bool parallel = pmul_enabled(n);
+    if (parallel) {
+        pmul_mod_init(&ctx, n);
+    }
 
     mpz_inits(y, a, r, n_minus_1, two_mpz, NULL);
 
@@ -130,15 +160,19 @@ bool is_prime(mpz_t n, uint64_t iters) {
     for (uint64_t i = 0; i < iters; i++) {
         // choose random a ∈ {2,3,...,n − 2}
 
-        // To achieve this, we call mpz_urandomm(). However, this generates
-        // random numbers from 0,...,n-1. Consequently, we first initialize
-        // a temporary variable to n-4, generate the random number, and
-        // add 2 to it.
+        // To achieve this, we call randstate_urandomm(). However, this
+        // generates random numbers from 0,...,n-1. Consequently, we first
+        // initialize a temporary variable to n-4, generate the random
+        // number, and add 2 to it.
         mpz_sub_ui(a, n, 4);
-        mpz_urandomm(a, state, a);
+        randstate_urandomm(a, a);
         mpz_add_ui(a, a, 2);
 
-        pow_mod(y, a, r, n);
+        if (parallel) {
+            pmul_pow_mod(&ctx, y, a, r);
+        } else {
+            pow_mod(y, a, r, n);
+        }
 
         // If y != 1 and y != n-1
         if (mpz_cmp_ui(y, 1) && mpz_cmp(y, n_minus_1)) {
@@ -146,11 +180,19 @@ bool is_prime(mpz_t n, uint64_t iters) {
 
             // While j < s and y != n-1
             while (j < s && mpz_cmp(y, n_minus_1)) {
-                pow_mod(y, y, two_mpz, n);
+                if (parallel) {
+                    pmul_sqr(y, y);
+                    pmul_reduce(&ctx, y, y);
+                } else {
+                    pow_mod(y, y, two_mpz, n);
+                }
 
                 // if y == 1
                 if (!mpz_cmp_ui(y, 1)) {
                     mpz_clears(y, a, r, n_minus_1, two_mpz, NULL);
+                    if (parallel) {
+                        pmul_mod_clear(&ctx);
+                    }
                     return false;
                 }
                 j++;
@@ -159,11 +201,17 @@ bool is_prime(mpz_t n, uint64_t iters) {
             // if y != n-1
             if (mpz_cmp(y, n_minus_1)) {
                 mpz_clears(y, a, r, n_minus_1, two_mpz, NULL);
+                if (parallel) {
+                    pmul_mod_clear(&ctx);
+                }
                 return false;
             }
         }
     }
     mpz_clears(y, a, r, n_minus_1, two_mpz, NULL);
+    if (parallel) {
+        pmul_mod_clear(&ctx);
+    }
     return true;
 }
 
@@ -199,26 +247,108 @@ void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
     return;
 }
 */
+// Generates a random prime of exactly bits bits (at least 3). The two most
+// significant bits are set, so that the product of two such primes has
+// exactly the sum of their bit lengths. Starting from a random odd number,
+// it steps through odd candidates till is_prime accepts one.
+//
+// Input parameters:
+// p: mpz_t: Prime number is stored here
+// bits: uint64_t: Number of bits in the generated number
+// iters: uint64_t: Number of iterations to validate primarily
+// Returns: void
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-    mpz_t two_mpz;
-    mpz_init(two_mpz);
-
-    // Create an mpz_t variable with value 2 and raise it to the desired power
-    mpz_set_ui(two_mpz, 2);
-    mpz_pow_ui(p, two_mpz, bits + 1);
+    if (bits < 3) {
+        bits = 3;
+    }
 
-    // Subtract 1 from p to generate a potential mersenne prime number
-    mpz_add_ui(p, p, 1);
+    randstate_urandomb(p, bits);
+    mpz_setbit(p, bits - 1);
+    mpz_setbit(p, bits - 2);
+    mpz_setbit(p, 0);
 
-    // Keep incrementing the bits till we get a prime number
+    // Keep stepping to the next odd number till we get a prime number. If
+    // the search runs past bits bits, start again from a new random number.
     while (!is_prime(p, iters)) {
-        /*
-        bits++;
-        mpz_pow_ui(p, two_mpz, bits);
-        */
         mpz_add_ui(p, p, 2);
+        if (mpz_sizeinbase(p, 2) > bits) {
+            randstate_urandomb(p, bits);
+            mpz_setbit(p, bits - 1);
+            mpz_setbit(p, bits - 2);
+            mpz_setbit(p, 0);
+        }
     }
-
-    mpz_clear(two_mpz);
     return;
 }
+
+// State shared by the make_primes workers
+typedef struct {
+    mpz_t *primes;
+    uint64_t *bits;
+    uint32_t count;
+    uint64_t iters;
+    uint64_t stream;
+    uint32_t next;
+    pthread_mutex_t lock;
+} prime_tasks_t;
+
+// make_primes worker. Prime i is always generated from random stream
+// (stream + i), whichever thread happens to claim it.
+static void *make_primes_worker(void *arg) {
+    prime_tasks_t *t = arg;
+    randstate_t rs, *prev;
+    uint32_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&t->lock);
+        i = t->next++;
+        pthread_mutex_unlock(&t->lock);
+        if (i >= t->count) {
+            break;
+        }
+        if (mpz_sgn(t->primes[i])) {
+            continue;
+        }
+
+        randstate_stream(&rs, t->stream + i);
+        prev = randstate_bind(&rs);
+        make_prime(t->primes[i], t->bits[i], t->iters);
+        randstate_bind(prev);
+    }
+    return NULL;
+}
+
+// Generates count primes, of bits[i] bits each, on up to nthreads threads.
+// Each prime comes from its own random stream, whose id is drawn from the
+// caller's stream, so the result for a given seed is the same for any
+// number of threads. Primes that are non-zero on entry are left as they are.
+//
+// Input parameters:
+// primes: mpz_t[]: The primes are stored here
+// bits: uint64_t[]: Number of bits of each prime
+// count: uint32_t: Number of primes
+// iters: uint64_t: Number of iterations to validate primarily
+// nthreads: uint32_t: Maximum number of threads
+// Returns: void
+void make_primes(mpz_t primes[], uint64_t bits[], uint32_t count, uint64_t iters, uint32_t nthreads) {
+    prime_tasks_t t = { primes, bits, count, iters, randstate_u64(), 0, PTHREAD_MUTEX_INITIALIZER };
+    pthread_t *threads;
+
+    if (nthreads > count) {
+        nthreads = count;
+    }
+    if (nthreads <= 1) {
+        make_primes_worker(&t);
+        return;
+    }
+
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, make_primes_worker, &t);
+    }
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&t.lock);
+}
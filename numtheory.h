@@ -14,3 +14,5 @@ void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
 bool is_prime(mpz_t n, uint64_t iters);
 
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_primes(mpz_t primes[], uint64_t bits[], uint32_t count, uint64_t iters, uint32_t nthreads);
@@ -1,10 +1,161 @@
+#include "hex.h"
 #include "numtheory.h"
+#include "pmul.h"
 #include "randstate.h"
+#include "rsa.h"
+#include "sha256.h"
 
-gmp_randstate_t state;
+#include <stdlib.h>
+#include <string.h>
 
+// Writes z with hex_write_mpz and with gmp_fprintf, checks that the two
+// texts are the same, then reads the text back with hex_read_mpz and checks
+// it against mpz_set_str. pad leading zero nibbles are put in front of the
+// text read back.
+//
+// Input parameters:
+// z: mpz_t: Number to check
+// pad: uint32_t: Number of leading zeros to read back
+// Returns: bool: True if hex.c agrees with GMP
+bool check_hex(mpz_t z, uint32_t pad) {
+    char *ours = NULL, *gmps = NULL;
+    size_t ours_len, gmps_len;
+    FILE *fp;
+    mpz_t r, g;
+    bool ok;
+
+    mpz_inits(r, g, NULL);
+    fp = open_memstream(&ours, &ours_len);
+    hex_write_mpz(fp, z);
+    fclose(fp);
+    fp = open_memstream(&gmps, &gmps_len);
+    gmp_fprintf(fp, "%Zx\n", z);
+    fclose(fp);
+    ok = ours_len == gmps_len && !memcmp(ours, gmps, ours_len);
+
+    fp = tmpfile();
+    fprintf(fp, "%0*d%s", (int) pad, 0, gmps);
+    rewind(fp);
+    ok = ok && hex_read_mpz(fp, r);
+    fclose(fp);
+    gmps[gmps_len - 1] = '\0';
+    mpz_set_str(g, gmps, 16);
+    ok = ok && !mpz_cmp(r, g) && !mpz_cmp(r, z);
+
+    free(ours);
+    free(gmps);
+    mpz_clears(r, g, NULL);
+    return ok;
+}
+
+// Hashes msg with sha256, repeated reps times through sha256_update, and
+// compares the digest with the expected one, given in hex.
+//
+// Input parameters:
+// msg: char *: Message
+// reps: uint32_t: Number of times the message is repeated
+// expected: char *: Expected digest as 64 hex digits
+// Returns: bool: True if the digest matches
+bool check_sha256(char *msg, uint32_t reps, char *expected) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+    sha256_t ctx;
+
+    sha256_init(&ctx);
+    for (uint32_t i = 0; i < reps; i++) {
+        sha256_update(&ctx, msg, strlen(msg));
+    }
+    sha256_final(&ctx, digest);
+    for (uint32_t i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+    return !strcmp(hex, expected);
+}
+
+// Encrypts count random messages, message i with the i-th of the batch
+// exponents of the key made of primes, decrypts them at once with
+// rsa_decrypt_batch, and checks every result against rsa_decrypt_crt.
+//
+// Input parameters:
+// primes: mpz_t[]: Two primes making up the modulus
+// count: uint32_t: Number of messages, at most 8
+// Returns: bool: True if every message decrypts to the same value both ways
+bool check_batch(mpz_t primes[], uint32_t count) {
+    mpz_t n, d, r, m[8], c[8], e[8], b[8];
+    rsa_crt_t crt;
+    bool ok;
+
+    mpz_inits(n, d, r, NULL);
+    rsa_crt_init(&crt);
+    mpz_mul(n, primes[0], primes[1]);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_inits(m[i], c[i], e[i], b[i], NULL);
+    }
+    rsa_make_batch_exponents(e, count, primes, 2);
+    for (uint32_t i = 0; i < count; i++) {
+        randstate_urandomm(m[i], n);
+        rsa_encrypt(c[i], m[i], e[i], n);
+    }
+
+    // rsa_decrypt_batch only needs the primes of crt.
+    rsa_crt_set(&crt, primes, 2, d);
+    ok = rsa_decrypt_batch(b, c, e, count, n, &crt);
+    for (uint32_t i = 0; ok && i < count; i++) {
+        rsa_make_priv_multi(d, e[i], primes, 2);
+        rsa_crt_set(&crt, primes, 2, d);
+        rsa_decrypt_crt(r, c[i], &crt);
+        ok = !mpz_cmp(r, b[i]) && !mpz_cmp(r, m[i]);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_clears(m[i], c[i], e[i], b[i], NULL);
+    }
+    rsa_crt_clear(&crt);
+    mpz_clears(n, d, r, NULL);
+    return ok;
+}
+
+// Writes a private key whose modulus is the product of the given factors
+// to a temporary file, and reads the factors back with
+// rsa_read_priv_primes.
+//
+// Input parameters:
+// factors: mpz_t[]: Factors of the modulus, distinct
+// count: uint32_t: Number of factors
+// Returns: bool: True if rsa_read_priv_primes accepted the factors
+bool check_read_primes(mpz_t factors[], uint32_t count) {
+    mpz_t n, d;
+    rsa_crt_t crt;
+    FILE *fp;
+    bool ok;
+
+    mpz_init_set_ui(n, 1);
+    mpz_init_set_ui(d, 65537);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_mul(n, n, factors[i]);
+    }
+    fp = tmpfile();
+    rsa_write_priv(n, d, fp);
+    rsa_write_priv_primes(factors, count, fp);
+    rewind(fp);
+
+    rsa_crt_init(&crt);
+    rsa_read_priv(n, d, fp);
+    ok = rsa_read_priv_primes(&crt, n, d, fp);
+    fclose(fp);
+
+    rsa_crt_clear(&crt);
+    mpz_clears(n, d, NULL);
+    return ok;
+}
+
+// Runs the checks, printing what each one found.
+//
+// Input parameters: None
+// Returns: int: 0 if every check passed, non-zero otherwise
 int main() {
     mpz_t a, b, d, out;
+    uint32_t failed = 0;
 
     mpz_inits(a, b, d, out, NULL);
     randstate_init(0);
@@ -31,6 +182,16 @@ int main() {
         printf("Number is not prime\n\n");
     }
 
+    printf("Testing is_prime on small numbers. The primes below 30 should be listed\n");
+    for (uint32_t i = 0; i < 30; i++) {
+        mpz_set_ui(d, i);
+        if (is_prime(d, 50)) {
+            printf("%u ", i);
+        }
+        failed += is_prime(d, 50) != (mpz_probab_prime_p(d, 25) > 0);
+    }
+    printf("\n\n");
+
     // Testing modular inverse
     printf("Testing modular inverse. The answer should be 533\n");
     mpz_set_ui(a, 197);
@@ -49,6 +210,90 @@ int main() {
     make_prime(out, 130, 50);
     gmp_printf("Prime number of approx 130 bits = (%ld bits) %Zd\n", mpz_sizeinbase(out, 2), out);
 
+    // Every size from 0 to 600 bits, so that the hex lengths cross the 16
+    // and 32 byte vector widths, with and without leading zero nibbles.
+    printf("Testing hex_write_mpz and hex_read_mpz against GMP\n");
+    uint32_t bad = 0;
+    for (uint32_t bits = 0; bits <= 600; bits++) {
+        randstate_urandomb(a, bits);
+        if (bits > 0) {
+            mpz_setbit(a, bits - 1);
+        }
+        bad += !check_hex(a, 0) + !check_hex(a, bits % 5 + 1);
+    }
+    printf("%s\n\n", bad ? "Results differ" : "Results match");
+    failed += bad;
+
+    // Known answers from FIPS 180-2: "abc", the empty string, a two block
+    // message, and a million 'a's fed in one byte at a time.
+    printf("Testing sha256 against known answers\n");
+    bad = !check_sha256("abc", 1,
+              "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad")
+          + !check_sha256("", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855")
+          + !check_sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+              "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1")
+          + !check_sha256("a", 1000000,
+              "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    printf("%s\n\n", bad ? "Results differ" : "Results match");
+    failed += bad;
+
+    printf("Testing rsa_decrypt_batch against rsa_decrypt_crt\n");
+    mpz_t primes[2];
+    mpz_inits(primes[0], primes[1], NULL);
+    make_prime(primes[0], 512, 20);
+    do {
+        make_prime(primes[1], 512, 20);
+    } while (!mpz_cmp(primes[0], primes[1]));
+    bad = 0;
+    for (uint32_t count = 1; count <= 8; count++) {
+        if (!check_batch(primes, count)) {
+            printf("Batch of %u differs\n", count);
+            bad++;
+        }
+    }
+    printf("%s\n\n", bad ? "Results differ" : "Results match");
+    failed += bad;
+    mpz_clears(primes[0], primes[1], NULL);
+
+    // Three primes are accepted; the same modulus split into a prime and a
+    // composite factor is not.
+    printf("Testing rsa_read_priv_primes with prime and composite factors\n");
+    mpz_t factors[3];
+    mpz_inits(factors[0], factors[1], factors[2], NULL);
+    make_prime(factors[0], 256, 20);
+    do {
+        make_prime(factors[1], 256, 20);
+        make_prime(factors[2], 256, 20);
+    } while (!mpz_cmp(factors[0], factors[1]) || !mpz_cmp(factors[0], factors[2])
+             || !mpz_cmp(factors[1], factors[2]));
+    bad = !check_read_primes(factors, 3);
+    mpz_mul(factors[1], factors[1], factors[2]);
+    bad += check_read_primes(factors, 2);
+    printf("%s\n\n", bad ? "Results differ" : "Results match");
+    failed += bad;
+    mpz_clears(factors[0], factors[1], factors[2], NULL);
+
+    printf("Testing pow_mod on the parallel path against mpz_powm\n");
+    pmul_init(4);
+    pmul_threshold = 0;
+    randstate_urandomb(d, 4096);
+    mpz_setbit(d, 4095);
+    randstate_urandomm(a, d);
+    randstate_urandomb(b, 512);
+    pow_mod(out, a, b, d);
+    mpz_powm(a, a, b, d);
+    bad = mpz_cmp(out, a) != 0;
+    printf("%s\n", bad ? "Results differ" : "Results match");
+    make_prime(out, 1024, 20);
+    printf("1024 bit prime made on the parallel path: %s\n\n",
+        mpz_probab_prime_p(out, 25) ? "prime" : "not prime");
+    failed += bad + !mpz_probab_prime_p(out, 25);
+
+    pmul_shutdown();
     mpz_clears(a, b, d, out, NULL);
+    if (failed) {
+        printf("%u checks failed\n", failed);
+        return EXIT_FAILURE;
+    }
     return 0;
 }
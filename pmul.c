@@ -0,0 +1,402 @@
+#include "pmul.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Parallel multiplication for very large operands. A product is split into
+// independent sub-products, which are handed to a persistent pool of
+// threads, and the partial results are then shifted and added together.
+// Reduction modulo n uses Barrett's method, which turns it into two more
+// multiplications that are split the same way.
+//
+// The pool only exists once a program asks for it with pmul_init, and is
+// stopped with pmul_shutdown. Without a pool, below pmul_threshold bits, or
+// on a single CPU, everything goes straight to GMP, since handing work to
+// other threads costs several microseconds.
+
+// Largest number of pieces an operand is split into
+#define PMUL_MAX_PIECES 8
+#define PMUL_MAX_TASKS (PMUL_MAX_PIECES * (PMUL_MAX_PIECES + 1) / 2)
+
+// Operand size, in bits, from which pmul_mul and pmul_sqr split the work.
+// 8192 bits is the prime size of a 16384-bit two-prime key, the smallest key
+// this layer is meant for. This default has not been measured on a
+// multi-core machine; run the bench
+// program to find the crossover on a given machine, and pass it to keygen
+// with -M.
+uint64_t pmul_threshold = 1 << 13;
+
+// One sub-product: rop = a * b
+typedef struct {
+    mpz_ptr rop;
+    mpz_ptr a;
+    mpz_ptr b;
+} pmul_task_t;
+
+// A set of sub-products submitted together
+typedef struct pmul_job {
+    pmul_task_t *tasks;
+    uint32_t ntasks;
+    uint32_t next; // Next task to claim
+    uint32_t done; // Number of finished tasks
+    struct pmul_job *queue; // Next job waiting for threads
+} pmul_job_t;
+
+// The thread pool. Jobs wait in a queue until all their tasks are claimed.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when a job is queued, or on shutdown
+    pthread_cond_t finished; // Signalled when a job is done
+    pmul_job_t *head;
+    pthread_t *threads; // Worker threads
+    uint32_t nthreads; // Worker threads plus the submitting thread
+    bool stop; // Set by pmul_shutdown
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL,
+    NULL, 0, false };
+
+// Claims the next task of job, taking the job off the queue once all its
+// tasks are claimed. Must be called with the pool lock held.
+//
+// Input parameters:
+// job: pmul_job_t *: A queued job with unclaimed tasks
+// Returns: pmul_task_t *: The claimed task
+static pmul_task_t *pmul_claim(pmul_job_t *job) {
+    pmul_task_t *task = &job->tasks[job->next++];
+
+    if (job->next == job->ntasks) {
+        pmul_job_t **p = &pool.head;
+        while (*p != job) {
+            p = &(*p)->queue;
+        }
+        *p = job->queue;
+    }
+    return task;
+}
+
+// Runs a claimed task, and records that it is done.
+static void pmul_run_task(pmul_job_t *job, pmul_task_t *task) {
+    mpz_mul(task->rop, task->a, task->b);
+
+    pthread_mutex_lock(&pool.lock);
+    if (++job->done == job->ntasks) {
+        pthread_cond_broadcast(&pool.finished);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Worker thread. Runs tasks till pmul_shutdown is called.
+static void *pmul_worker(void *arg) {
+    (void) arg;
+    for (;;) {
+        pmul_job_t *job;
+        pmul_task_t *task;
+
+        pthread_mutex_lock(&pool.lock);
+        while (pool.head == NULL && !pool.stop) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        if (pool.head == NULL) {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        job = pool.head;
+        task = pmul_claim(job);
+        pthread_mutex_unlock(&pool.lock);
+
+        pmul_run_task(job, task);
+    }
+    return NULL;
+}
+
+// Starts the thread pool, if it has not been started yet. Otherwise the
+// existing pool is kept. Until this is called, pmul_mul, pmul_sqr and
+// pow_mod never use other threads.
+//
+// Input parameters:
+// nthreads: uint32_t: Number of threads to multiply with, including the
+// calling thread. 0 means the number of CPUs.
+// Returns: uint32_t: Number of threads in the pool, including the caller
+uint32_t pmul_init(uint32_t nthreads) {
+    pthread_mutex_lock(&pool.lock);
+    if (pool.nthreads == 0) {
+        if (nthreads == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            nthreads = cpus > 0 ? cpus : 1;
+        }
+        pool.nthreads = 1;
+        pool.threads = (pthread_t *) calloc(nthreads > 1 ? nthreads - 1 : 1, sizeof(pthread_t));
+        for (uint32_t i = 1; i < nthreads; i++) {
+            if (pthread_create(&pool.threads[i - 1], NULL, pmul_worker, NULL) != 0) {
+                break;
+            }
+            pool.nthreads++;
+        }
+    }
+    nthreads = pool.nthreads;
+    pthread_mutex_unlock(&pool.lock);
+    return nthreads;
+}
+
+// Stops the worker threads started by pmul_init and waits for them to exit.
+// No multiplication may be running. pmul_init may be called again after.
+//
+// Returns: void
+void pmul_shutdown(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (uint32_t i = 1; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i - 1], NULL);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.nthreads = 0;
+    pool.stop = false;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Returns the number of threads in the pool, including the caller, or 0 if
+// pmul_init has not been called.
+static uint32_t pmul_threads(void) {
+    uint32_t nthreads;
+
+    pthread_mutex_lock(&pool.lock);
+    nthreads = pool.nthreads;
+    pthread_mutex_unlock(&pool.lock);
+    return nthreads;
+}
+
+// Tells whether arithmetic modulo n is large enough to be split across
+// threads, and whether a pool with more than one thread has been started to
+// split it across.
+//
+// Input parameters:
+// n: mpz_t: Modulus
+// Returns: bool: True if pmul should be used
+bool pmul_enabled(mpz_t n) {
+    return mpz_sizeinbase(n, 2) >= pmul_threshold && pmul_threads() > 1;
+}
+
+// Computes all the tasks, the calling thread taking its share.
+//
+// Input parameters:
+// tasks: pmul_task_t *: Sub-products to compute
+// ntasks: uint32_t: Number of sub-products
+// Returns: void
+static void pmul_run(pmul_task_t *tasks, uint32_t ntasks) {
+    pmul_job_t job = { tasks, ntasks, 0, 0, NULL };
+    pmul_job_t **p;
+
+    pthread_mutex_lock(&pool.lock);
+    for (p = &pool.head; *p != NULL; p = &(*p)->queue) {
+    }
+    *p = &job;
+    pthread_cond_broadcast(&pool.work);
+
+    while (job.next < job.ntasks) {
+        pmul_task_t *task = pmul_claim(&job);
+        pthread_mutex_unlock(&pool.lock);
+        pmul_run_task(&job, task);
+        pthread_mutex_lock(&pool.lock);
+    }
+    while (job.done < job.ntasks) {
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Splits a into count pieces of bits bits, lowest first.
+static void pmul_split(mpz_t piece[], mpz_t a, uint32_t count, uint64_t bits) {
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_tdiv_q_2exp(piece[i], a, i * bits);
+        mpz_tdiv_r_2exp(piece[i], piece[i], bits);
+    }
+}
+
+// Computes rop = a * b. The larger operand is split into one piece per
+// thread, and each piece is multiplied by the other operand.
+//
+// Input parameters:
+// rop: mpz_t: The product is stored here
+// a, b: mpz_t: Operands
+// Returns: void
+void pmul_mul(mpz_t rop, mpz_t a, mpz_t b) {
+    mpz_ptr big = mpz_size(a) >= mpz_size(b) ? a : b;
+    mpz_ptr small = big == a ? b : a;
+    uint64_t size = mpz_sizeinbase(big, 2);
+    pmul_task_t tasks[PMUL_MAX_PIECES];
+    mpz_t piece[PMUL_MAX_PIECES], prod[PMUL_MAX_PIECES], other;
+    uint32_t count;
+    uint64_t bits;
+
+    if (size < pmul_threshold || (count = pmul_threads()) < 2) {
+        mpz_mul(rop, a, b);
+        return;
+    }
+    if (count > PMUL_MAX_PIECES) {
+        count = PMUL_MAX_PIECES;
+    }
+    bits = (size + count - 1) / count;
+
+    // The operands are copied, so that rop may alias them.
+    mpz_init_set(other, small);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_inits(piece[i], prod[i], NULL);
+    }
+    pmul_split(piece, big, count, bits);
+    for (uint32_t i = 0; i < count; i++) {
+        tasks[i] = (pmul_task_t) { prod[i], piece[i], other };
+    }
+    pmul_run(tasks, count);
+
+    // The pieces carry the sign of big, so the sum has the right sign.
+    mpz_set_ui(rop, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_mul_2exp(prod[i], prod[i], i * bits);
+        mpz_add(rop, rop, prod[i]);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_clears(piece[i], prod[i], NULL);
+    }
+    mpz_clear(other);
+}
+
+// Computes rop = a^2. a is split into q pieces a_i, and the q(q+1)/2
+// distinct products a_i * a_j are computed in parallel, which keeps the
+// saving of squaring over a general multiplication.
+//
+// Input parameters:
+// rop: mpz_t: The square is stored here
+// a: mpz_t: Operand
+// Returns: void
+void pmul_sqr(mpz_t rop, mpz_t a) {
+    uint64_t size = mpz_sizeinbase(a, 2);
+    pmul_task_t tasks[PMUL_MAX_TASKS];
+    mpz_t piece[PMUL_MAX_PIECES], prod[PMUL_MAX_TASKS];
+    uint32_t nthreads, q = 2, ntasks = 0;
+    uint64_t bits;
+
+    if (size < pmul_threshold || (nthreads = pmul_threads()) < 2) {
+        mpz_mul(rop, a, a);
+        return;
+    }
+
+    // Enough pieces to give every thread at least one product
+    while (q < PMUL_MAX_PIECES && q * (q + 1) / 2 < nthreads) {
+        q++;
+    }
+    bits = (size + q - 1) / q;
+
+    for (uint32_t i = 0; i < q; i++) {
+        mpz_init(piece[i]);
+    }
+    pmul_split(piece, a, q, bits);
+    for (uint32_t i = 0; i < q; i++) {
+        for (uint32_t j = i; j < q; j++) {
+            mpz_init(prod[ntasks]);
+            tasks[ntasks] = (pmul_task_t) { prod[ntasks], piece[i], piece[j] };
+            ntasks++;
+        }
+    }
+    pmul_run(tasks, ntasks);
+
+    // a^2 = sum of a_i^2 2^(2i bits) + 2 a_i a_j 2^((i+j) bits) for i < j
+    mpz_set_ui(rop, 0);
+    ntasks = 0;
+    for (uint32_t i = 0; i < q; i++) {
+        for (uint32_t j = i; j < q; j++) {
+            mpz_mul_2exp(prod[ntasks], prod[ntasks], (i + j) * bits + (i != j));
+            mpz_add(rop, rop, prod[ntasks]);
+            mpz_clear(prod[ntasks]);
+            ntasks++;
+        }
+        mpz_clear(piece[i]);
+    }
+}
+
+// Prepares Barrett reduction modulo n.
+//
+// Input parameters:
+// ctx: pmul_mod_t *: Reduction context to initialize
+// n: mpz_t: Modulus, greater than 1
+// Returns: void
+void pmul_mod_init(pmul_mod_t *ctx, mpz_t n) {
+    mpz_inits(ctx->n, ctx->mu, NULL);
+    mpz_set(ctx->n, n);
+    ctx->k = mpz_sizeinbase(n, 2);
+
+    // mu = floor(2^(2k) / n)
+    mpz_setbit(ctx->mu, 2 * ctx->k);
+    mpz_fdiv_q(ctx->mu, ctx->mu, n);
+}
+
+// Clears a reduction context.
+//
+// Input parameters:
+// ctx: pmul_mod_t *: Reduction context
+// Returns: void
+void pmul_mod_clear(pmul_mod_t *ctx) {
+    mpz_clears(ctx->n, ctx->mu, NULL);
+}
+
+// Computes rop = x mod n with Barrett reduction, using pmul_mul for both
+// multiplications.
+//
+// Input parameters:
+// ctx: pmul_mod_t *: Reduction context for n
+// rop: mpz_t: The result is stored here
+// x: mpz_t: Number to reduce, with 0 <= x < n^2
+// Returns: void
+void pmul_reduce(pmul_mod_t *ctx, mpz_t rop, mpz_t x) {
+    mpz_t q;
+    mpz_init(q);
+
+    // q = floor(floor(x / 2^(k-1)) * mu / 2^(k+1)), which is at most 2
+    // less than floor(x / n).
+    mpz_tdiv_q_2exp(q, x, ctx->k - 1);
+    pmul_mul(q, q, ctx->mu);
+    mpz_tdiv_q_2exp(q, q, ctx->k + 1);
+    pmul_mul(q, q, ctx->n);
+    mpz_sub(rop, x, q);
+    while (mpz_cmp(rop, ctx->n) >= 0) {
+        mpz_sub(rop, rop, ctx->n);
+    }
+
+    mpz_clear(q);
+}
+
+// Computes out = base^exponent mod n, in the same way as pow_mod, but with
+// parallel multiplication and Barrett reduction.
+//
+// Input parameters:
+// ctx: pmul_mod_t *: Reduction context for n
+// out: mpz_t: Stores the result
+// base: mpz_t: Base
+// exponent: mpz_t: Exponent, not negative
+// Returns: void
+void pmul_pow_mod(pmul_mod_t *ctx, mpz_t out, mpz_t base, mpz_t exponent) {
+    mpz_t v, p, rop;
+    mpz_inits(v, p, rop, NULL);
+    mpz_set_ui(v, 1);
+    mpz_mod(p, base, ctx->n);
+
+    for (uint64_t i = 0, bits = mpz_sizeinbase(exponent, 2); mpz_sgn(exponent) > 0 && i < bits;
+         i++) {
+        if (mpz_tstbit(exponent, i)) {
+            pmul_mul(rop, v, p);
+            pmul_reduce(ctx, v, rop);
+        }
+        if (i + 1 < bits) {
+            pmul_sqr(rop, p);
+            pmul_reduce(ctx, p, rop);
+        }
+    }
+    mpz_mod(out, v, ctx->n);
+    mpz_clears(v, p, rop, NULL);
+}
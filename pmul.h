@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// Barrett reduction modulo n, for use with pmul_reduce
+typedef struct {
+    mpz_t n;
+    mpz_t mu; // floor(2^(2k) / n)
+    uint64_t k; // Number of bits of n
+} pmul_mod_t;
+
+extern uint64_t pmul_threshold;
+
+uint32_t pmul_init(uint32_t nthreads);
+
+void pmul_shutdown(void);
+
+bool pmul_enabled(mpz_t n);
+
+void pmul_mul(mpz_t rop, mpz_t a, mpz_t b);
+
+void pmul_sqr(mpz_t rop, mpz_t a);
+
+void pmul_mod_init(pmul_mod_t *ctx, mpz_t n);
+
+void pmul_mod_clear(pmul_mod_t *ctx);
+
+void pmul_reduce(pmul_mod_t *ctx, mpz_t rop, mpz_t x);
+
+void pmul_pow_mod(pmul_mod_t *ctx, mpz_t out, mpz_t base, mpz_t exponent);
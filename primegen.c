@@ -0,0 +1,145 @@
+#include "numtheory.h"
+#include "primepool.h"
+#include "randstate.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#define MAX_SIZES 8
+
+// Usage Function
+// Input parameters:
+// exec_name: char *: Name of the program
+// Returns: void
+void usage(char *exec_name) {
+    printf("USAGE: %s -b <num_bits> [-b <num_bits> ...][-c <count>][-d <pool_dir>][-i "
+           "<num_iters>][-w <seconds>][-s <seed>][-vh]\n",
+        exec_name);
+    printf("-b <num_bits>: Size of the primes to keep in the pool. May be repeated, up to %d "
+           "times\n",
+        MAX_SIZES);
+    printf("-c <count>: Number of primes to keep in each pool. Default is 16\n");
+    printf("-d <pool_dir>: Directory holding the pool files. Default is the current directory\n");
+    printf("-i <num_iters>: Number of Miller-Rabin iterations for testing primes\n");
+    printf("-w <seconds>: Keep running, topping the pools up every <seconds> seconds\n");
+    printf("-s <seed>: Seed for random state initialization. Default is a seed read from the "
+           "system's random source\n");
+    printf("-v: Turn on verbose mode\n");
+    printf("-h: Print this message\n");
+    return;
+}
+
+// Tops up the pool of bits-bit primes in dir to count primes. Each prime is
+// generated without holding the pool lock, so consumers are never blocked
+// behind a prime search.
+//
+// Input parameters:
+// dir: char *: Directory holding the pool files
+// bits: uint64_t: Size of the primes
+// count: uint64_t: Number of primes to keep in the pool
+// iters: uint64_t: Number of Miller-Rabin iterations
+// verbose: bool: Print each prime as it is added
+// Returns: bool: True in case of success
+bool top_up(char *dir, uint64_t bits, uint64_t count, uint64_t iters, bool verbose) {
+    primepool_t pool;
+    uint64_t have;
+    mpz_t p;
+
+    if (!primepool_open(&pool, dir, bits)) {
+        printf("Could not open the pool of %lu-bit primes in %s\n", (unsigned long) bits, dir);
+        return false;
+    }
+
+    mpz_init(p);
+    while ((have = primepool_count(&pool)) < count) {
+        make_prime(p, bits, iters);
+        if (!primepool_add(&pool, p)) {
+            printf("Could not add a prime to the pool of %lu-bit primes\n", (unsigned long) bits);
+            mpz_clear(p);
+            primepool_close(&pool);
+            return false;
+        }
+        if (verbose) {
+            printf("%lu-bit pool: %lu of %lu\n", (unsigned long) bits, (unsigned long) have + 1,
+                (unsigned long) count);
+        }
+    }
+
+    mpz_clear(p);
+    primepool_close(&pool);
+    return true;
+}
+
+// The main function
+//
+// Input parameters:
+// argc: int: Number of input arguments
+// argv: char **: The input arguments
+// Returns: int: 0 in case of success, non-zero for failure
+int main(int argc, char **argv) {
+    int opt;
+    uint64_t sizes[MAX_SIZES];
+    uint32_t nsizes = 0;
+    uint64_t count = 16;
+    uint32_t mr_iters = 50;
+    uint32_t interval = 0;
+    char *pool_dir = ".";
+    bool verbose = false;
+    bool ok = true;
+
+    uint64_t seed = 0;
+    bool have_seed = false;
+
+    // Parse the input options.
+    while ((opt = getopt(argc, argv, "b:c:d:i:w:s:vh")) != -1) {
+        switch (opt) {
+        case ('b'):
+            if (nsizes == MAX_SIZES) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            sizes[nsizes++] = strtoul(optarg, NULL, 10);
+            break;
+        case ('c'): count = strtoul(optarg, NULL, 10); break;
+        case ('d'): pool_dir = optarg; break;
+        case ('i'): mr_iters = strtoul(optarg, NULL, 10); break;
+        case ('w'): interval = strtoul(optarg, NULL, 10); break;
+        case ('s'):
+            seed = strtoul(optarg, NULL, 10);
+            have_seed = true;
+            break;
+        case ('v'): verbose = true; break;
+        case ('h'): usage(argv[0]); return 0;
+        default: usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+
+    if (nsizes == 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Without -s the seed comes from the kernel, so that generators started
+    // at the same time, or on machines with the same clock, never produce
+    // the same primes.
+    if (!have_seed && getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        printf("Could not read a random seed. Please provide one with -s\n");
+        exit(EXIT_FAILURE);
+    }
+    randstate_init(seed);
+
+    // Fill every pool once, then, with -w, keep refilling them as keygen
+    // drains them.
+    do {
+        for (uint32_t i = 0; i < nsizes && ok; i++) {
+            ok = top_up(pool_dir, sizes[i], count, mr_iters, verbose);
+        }
+        if (ok && interval > 0) {
+            sleep(interval);
+        }
+    } while (ok && interval > 0);
+
+    randstate_clear();
+    return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,235 @@
+#include "primepool.h"
+#include "numtheory.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define POOL_MAGIC "RSAPOOL1"
+
+// A pool file is this header followed by (tail - head) live slots starting
+// at slot head. Each slot holds one prime as a big endian number of exactly
+// slot_bytes bytes. Slots before head have been consumed and zeroed; they
+// are reclaimed the next time a prime is added.
+typedef struct {
+    char magic[8];
+    uint64_t bits;
+    uint64_t slot_bytes;
+    uint64_t head;
+    uint64_t tail;
+} pool_hdr_t;
+
+// Maps the whole pool file. The caller must hold the lock.
+//
+// Input parameters:
+// pool: primepool_t *: Open pool
+// len: size_t *: Length of the mapping is stored here
+// Returns: pool_hdr_t *: Start of the mapping, or NULL on failure
+static pool_hdr_t *pool_map(primepool_t *pool, size_t *len) {
+    struct stat st;
+    void *map;
+
+    if (fstat(pool->fd, &st) != 0 || (size_t) st.st_size < sizeof(pool_hdr_t)) {
+        return NULL;
+    }
+    *len = st.st_size;
+    map = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+// Writes the mapping back to disk and unmaps it.
+static void pool_unmap(pool_hdr_t *hdr, size_t len) {
+    msync(hdr, len, MS_SYNC);
+    munmap(hdr, len);
+}
+
+static uint8_t *pool_slot(pool_hdr_t *hdr, uint64_t i) {
+    return (uint8_t *) (hdr + 1) + i * hdr->slot_bytes;
+}
+
+// Opens the pool of bits-bit primes in dir, creating it if needed. The pool
+// file is created with 0600 permissions, since it holds future private keys.
+//
+// Input parameters:
+// pool: primepool_t *: Pool to open
+// dir: char *: Directory holding the pool files
+// bits: uint64_t: Size of the primes in the pool
+// Returns: bool: True in case of success
+bool primepool_open(primepool_t *pool, char *dir, uint64_t bits) {
+    char path[PATH_MAX];
+    pool_hdr_t *hdr;
+    struct stat st;
+    size_t len;
+    bool ok;
+
+    snprintf(path, sizeof(path), "%s/primes-%lu.pool", dir, (unsigned long) bits);
+    if ((pool->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0) {
+        return false;
+    }
+    pool->bits = bits;
+
+    flock(pool->fd, LOCK_EX);
+
+    // A new file gets its header. The lock makes sure only one process does it.
+    if (fstat(pool->fd, &st) == 0 && st.st_size == 0) {
+        if (ftruncate(pool->fd, sizeof(pool_hdr_t)) == 0 && (hdr = pool_map(pool, &len)) != NULL) {
+            memcpy(hdr->magic, POOL_MAGIC, 8);
+            hdr->bits = bits;
+            hdr->slot_bytes = (bits + 7) / 8;
+            hdr->head = 0;
+            hdr->tail = 0;
+            pool_unmap(hdr, len);
+        }
+    }
+
+    ok = (hdr = pool_map(pool, &len)) != NULL;
+    if (ok) {
+        ok = !memcmp(hdr->magic, POOL_MAGIC, 8) && hdr->bits == bits
+             && hdr->slot_bytes == (bits + 7) / 8 && hdr->head <= hdr->tail
+             && len >= sizeof(pool_hdr_t) + hdr->tail * hdr->slot_bytes;
+        munmap(hdr, len);
+    }
+
+    flock(pool->fd, LOCK_UN);
+    if (!ok) {
+        close(pool->fd);
+        pool->fd = -1;
+    }
+    return ok;
+}
+
+// Closes a pool opened with primepool_open.
+//
+// Input parameters:
+// pool: primepool_t *: Pool to close
+// Returns: void
+void primepool_close(primepool_t *pool) {
+    if (pool->fd >= 0) {
+        close(pool->fd);
+        pool->fd = -1;
+    }
+}
+
+// Returns the number of primes available in the pool.
+//
+// Input parameters:
+// pool: primepool_t *: Open pool
+// Returns: uint64_t: Number of unconsumed primes
+uint64_t primepool_count(primepool_t *pool) {
+    pool_hdr_t *hdr;
+    uint64_t count = 0;
+    size_t len;
+
+    flock(pool->fd, LOCK_EX);
+    if ((hdr = pool_map(pool, &len)) != NULL) {
+        count = hdr->tail - hdr->head;
+        munmap(hdr, len);
+    }
+    flock(pool->fd, LOCK_UN);
+    return count;
+}
+
+// Adds a prime to the pool. Consumed slots at the front of the file are
+// reclaimed first, so the file only ever holds live primes.
+//
+// Input parameters:
+// pool: primepool_t *: Open pool
+// p: mpz_t: Prime of pool->bits bits
+// Returns: bool: True in case of success
+bool primepool_add(primepool_t *pool, mpz_t p) {
+    size_t len, need = mpz_sizeinbase(p, 256);
+    pool_hdr_t *hdr;
+    uint64_t slot_bytes = (pool->bits + 7) / 8;
+    uint64_t live;
+    bool ok = false;
+
+    if (need > slot_bytes) {
+        return false;
+    }
+
+    flock(pool->fd, LOCK_EX);
+
+    if ((hdr = pool_map(pool, &len)) != NULL) {
+        live = hdr->tail - hdr->head;
+        if (hdr->head > 0) {
+            memmove(pool_slot(hdr, 0), pool_slot(hdr, hdr->head), live * slot_bytes);
+            hdr->head = 0;
+            hdr->tail = live;
+        }
+        pool_unmap(hdr, len);
+
+        if (ftruncate(pool->fd, sizeof(pool_hdr_t) + (live + 1) * slot_bytes) == 0
+            && (hdr = pool_map(pool, &len)) != NULL) {
+            uint8_t *slot = pool_slot(hdr, hdr->tail);
+            memset(slot, 0, slot_bytes);
+            mpz_export(slot + slot_bytes - need, NULL, 1, 1, 1, 0, p);
+            hdr->tail++;
+            pool_unmap(hdr, len);
+            ok = true;
+        }
+    }
+
+    flock(pool->fd, LOCK_UN);
+    return ok;
+}
+
+// Removes a prime from the pool. The slot is zeroed and the header updated
+// and synced to disk before the lock is released, so a prime is handed out
+// at most once, even if the process dies right after.
+//
+// Input parameters:
+// pool: primepool_t *: Open pool
+// p: mpz_t: The prime is stored here
+// Returns: bool: True if a prime was taken, false if the pool is empty
+bool primepool_take(primepool_t *pool, mpz_t p) {
+    pool_hdr_t *hdr;
+    bool ok = false;
+    size_t len;
+
+    flock(pool->fd, LOCK_EX);
+
+    if ((hdr = pool_map(pool, &len)) != NULL) {
+        if (hdr->head < hdr->tail) {
+            uint8_t *slot = pool_slot(hdr, hdr->head);
+            mpz_import(p, hdr->slot_bytes, 1, 1, 1, 0, slot);
+            memset(slot, 0, hdr->slot_bytes);
+            hdr->head++;
+            ok = true;
+        }
+        pool_unmap(hdr, len);
+    }
+
+    flock(pool->fd, LOCK_UN);
+    return ok;
+}
+
+// Takes one bits-bit prime from the pool in dir. The pool file is not
+// trusted: a number that is the wrong size or fails the primality test is
+// discarded, so a corrupted pool cannot put a composite into a key.
+//
+// Input parameters:
+// dir: char *: Directory holding the pool files
+// bits: uint64_t: Size of the prime
+// iters: uint64_t: Number of Miller-Rabin iterations to check the prime with
+// p: mpz_t: The prime is stored here, or 0 if none was taken
+// Returns: bool: True if a prime was taken. False if there is no pool for
+// that size, it is empty, or the number taken is not a bits-bit prime.
+bool primepool_draw(char *dir, uint64_t bits, uint64_t iters, mpz_t p) {
+    primepool_t pool;
+    bool ok;
+
+    if (!primepool_open(&pool, dir, bits)) {
+        return false;
+    }
+    ok = primepool_take(&pool, p) && mpz_sizeinbase(p, 2) == bits && is_prime(p, iters);
+    if (!ok) {
+        mpz_set_ui(p, 0);
+    }
+    primepool_close(&pool);
+    return ok;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// An on-disk pool of verified primes of one bit size, kept in
+// <dir>/primes-<bits>.pool. Every operation takes an exclusive lock on the
+// file, so any number of producers and consumers can share a pool.
+typedef struct {
+    int fd;
+    uint64_t bits;
+} primepool_t;
+
+bool primepool_open(primepool_t *pool, char *dir, uint64_t bits);
+
+void primepool_close(primepool_t *pool);
+
+uint64_t primepool_count(primepool_t *pool);
+
+bool primepool_add(primepool_t *pool, mpz_t p);
+
+bool primepool_take(primepool_t *pool, mpz_t p);
+
+bool primepool_draw(char *dir, uint64_t bits, uint64_t iters, mpz_t p);
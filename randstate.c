@@ -1,21 +1,178 @@
 #include "randstate.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a, b, c, d)                                                                             \
+    a += b, d ^= a, d = ROTL(d, 16);                                                               \
+    c += d, b ^= c, b = ROTL(b, 12);                                                               \
+    a += b, d ^= a, d = ROTL(d, 8);                                                                \
+    c += d, b ^= c, b = ROTL(b, 7)
+
+// The ChaCha20 key, derived from the seed. Written once by randstate_init
+// and only read afterwards.
+static uint32_t key[8];
+
+// Stream 0, bound to the thread that called randstate_init
+static randstate_t main_stream;
+
+// The stream each thread draws from
+static _Thread_local randstate_t *current;
+
+// Computes the next 64 byte keystream block of rs, and advances its counter.
+//
+// Input parameters:
+// rs: randstate_t *: Stream
+// Returns: void
+static void chacha_block(randstate_t *rs) {
+    uint32_t x[16];
+    memcpy(x, rs->input, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QR(x[0], x[4], x[8], x[12]);
+        QR(x[1], x[5], x[9], x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8], x[13]);
+        QR(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        rs->block[i] = x[i] + rs->input[i];
+    }
+
+    // Words 12 and 13 are a 64-bit block counter.
+    if (++rs->input[12] == 0) {
+        rs->input[13]++;
+    }
+    rs->used = 0;
+}
 
 // Input Parameters:
 // seed: uint64_t: Use seed as the random seed
 // Returns: void
 void randstate_init(uint64_t seed) {
-    srandom(seed);
-    gmp_randinit_mt(state);
-    gmp_randseed_ui(state, seed);
+    memset(key, 0, sizeof(key));
+    key[0] = (uint32_t) seed;
+    key[1] = (uint32_t) (seed >> 32);
+
+    randstate_stream(&main_stream, 0);
+    randstate_bind(&main_stream);
     return;
 }
 
-// Clears and frees the memory used by state.
+// Clears the seed and the main stream.
 //
 // Input parameters: None
 // Returns: void
 void randstate_clear(void) {
-    gmp_randclear(state);
+    memset(key, 0, sizeof(key));
+    memset(&main_stream, 0, sizeof(main_stream));
+    current = NULL;
     return;
 }
+
+// Initializes rs as stream stream_id of the seed given to randstate_init.
+// Different ids give independent streams.
+//
+// Input parameters:
+// rs: randstate_t *: Stream to initialize
+// stream_id: uint64_t: Stream id, used as the ChaCha20 nonce
+// Returns: void
+void randstate_stream(randstate_t *rs, uint64_t stream_id) {
+    // "expand 32-byte k"
+    rs->input[0] = 0x61707865;
+    rs->input[1] = 0x3320646e;
+    rs->input[2] = 0x79622d32;
+    rs->input[3] = 0x6b206574;
+    memcpy(rs->input + 4, key, sizeof(key));
+    rs->input[12] = 0;
+    rs->input[13] = 0;
+    rs->input[14] = (uint32_t) stream_id;
+    rs->input[15] = (uint32_t) (stream_id >> 32);
+    rs->used = 16;
+}
+
+// Makes the calling thread draw from rs.
+//
+// Input parameters:
+// rs: randstate_t *: Stream to bind
+// Returns: randstate_t *: The stream that was bound before, to be restored
+// by the caller when it is done with rs
+randstate_t *randstate_bind(randstate_t *rs) {
+    randstate_t *prev = current;
+    current = rs;
+    return prev;
+}
+
+// Returns the next 64 random bits from the calling thread's stream.
+//
+// Input parameters: None
+// Returns: uint64_t: Random number
+uint64_t randstate_u64(void) {
+    uint64_t v;
+
+    if (current == NULL) {
+        fprintf(stderr, "randstate: no random stream bound to this thread\n");
+        abort();
+    }
+    if (current->used > 14) {
+        chacha_block(current);
+    }
+    v = current->block[current->used] | ((uint64_t) current->block[current->used + 1] << 32);
+    current->used += 2;
+    return v;
+}
+
+// Generates a uniformly distributed random number in [0, 2^bits).
+//
+// Input parameters:
+// rop: mpz_t: The random number is stored here
+// bits: uint64_t: Number of random bits
+// Returns: void
+void randstate_urandomb(mpz_t rop, uint64_t bits) {
+    size_t nl = (bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    mp_limb_t *lp;
+
+    if (nl == 0) {
+        mpz_set_ui(rop, 0);
+        return;
+    }
+
+    lp = mpz_limbs_write(rop, nl);
+    for (size_t i = 0; i < nl; i++) {
+        lp[i] = (mp_limb_t) randstate_u64() & GMP_NUMB_MASK;
+    }
+    if (bits % GMP_NUMB_BITS) {
+        lp[nl - 1] &= ((mp_limb_t) 1 << (bits % GMP_NUMB_BITS)) - 1;
+    }
+    mpz_limbs_finish(rop, nl);
+}
+
+// Generates a uniformly distributed random number in [0, n), by rejection
+// sampling. rop and n may be the same variable.
+//
+// Input parameters:
+// rop: mpz_t: The random number is stored here
+// n: mpz_t: Upper bound, should be positive. rop is set to 0 otherwise,
+// since no number can be drawn.
+// Returns: void
+void randstate_urandomm(mpz_t rop, mpz_t n) {
+    uint64_t bits = mpz_sizeinbase(n, 2);
+    mpz_t bound;
+
+    if (mpz_sgn(n) <= 0) {
+        mpz_set_ui(rop, 0);
+        return;
+    }
+    mpz_init_set(bound, n);
+
+    do {
+        randstate_urandomb(rop, bits);
+    } while (mpz_cmp(rop, bound) >= 0);
+
+    mpz_clear(bound);
+}
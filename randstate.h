@@ -3,8 +3,26 @@
 #include <stdint.h>
 #include <gmp.h>
 
-extern gmp_randstate_t state;
+// A ChaCha20 keystream keyed by the seed. Each stream is identified by a
+// stream id, and the numbers it yields depend only on (seed, stream id), not
+// on which thread draws them or when. Every thread draws from the stream
+// bound to it with randstate_bind, so there is no shared mutable state.
+typedef struct {
+    uint32_t input[16];
+    uint32_t block[16];
+    uint32_t used;
+} randstate_t;
 
 void randstate_init(uint64_t seed);
 
 void randstate_clear(void);
+
+void randstate_stream(randstate_t *rs, uint64_t stream_id);
+
+randstate_t *randstate_bind(randstate_t *rs);
+
+uint64_t randstate_u64(void);
+
+void randstate_urandomb(mpz_t rop, uint64_t bits);
+
+void randstate_urandomm(mpz_t rop, mpz_t n);
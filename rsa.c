@@ -1,7 +1,71 @@
 #include "rsa.h"
+#include "bcache.h"
+#include "hex.h"
+#include "lz.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+
+// First line of a ciphertext whose plaintext was compressed before encryption
+#define RSA_LZ_HEADER "#lz"
+
+// Memory cap, in bytes, of the block cache each file encryption or
+// decryption uses to memoize repeated blocks. 0 disables the cache.
+size_t rsa_block_cache_bytes = 0;
+
+// Block cache statistics, summed over all calls and threads
+static atomic_uint_fast64_t rsa_block_cache_hits;
+static atomic_uint_fast64_t rsa_block_cache_lookups;
+
+// Prints how well the block cache has done so far. Prints nothing if the
+// cache is disabled.
+//
+// Returns: void
+void rsa_block_cache_report(void) {
+    uint64_t hits = atomic_load(&rsa_block_cache_hits);
+    uint64_t lookups = atomic_load(&rsa_block_cache_lookups);
+
+    if (rsa_block_cache_bytes > 0) {
+        printf("block cache: %" PRIu64 " of %" PRIu64 " blocks found (%.1f%%)\n", hits, lookups,
+            lookups > 0 ? 100.0 * hits / lookups : 0.0);
+    }
+}
+
+// Encrypts one block, looking it up in cache first when there is one.
+// Identical blocks always give identical ciphertexts, so a hit saves the
+// exponentiation.
+//
+// Input parameters:
+// c: mpz_t: Ciphertext
+// m: mpz_t: Scratch variable
+// block: uint8_t *: The 0xFF-prefixed block
+// len: size_t: Length of the block
+// e, n: mpz_t: Exponent and modulus
+// cache: bcache_t *: Block cache, or NULL
+// cbuf: uint8_t *: Scratch buffer large enough for n
+// Returns: bool: True on a cache hit
+static bool rsa_encrypt_block(mpz_t c, mpz_t m, uint8_t *block, size_t len, mpz_t e, mpz_t n,
+    bcache_t *cache, uint8_t *cbuf) {
+    const uint8_t *hit;
+    size_t clen;
+
+    if (cache != NULL && (hit = bcache_get(cache, block, len, &clen)) != NULL) {
+        mpz_import(c, clen, 1, 1, 1, 0, hit);
+        return true;
+    }
+    mpz_import(m, len, 1, 1, 1, 0, block);
+    rsa_encrypt(c, m, e, n);
+    if (cache != NULL) {
+        mpz_export(cbuf, &clen, 1, 1, 1, 0, c);
+        bcache_put(cache, block, len, cbuf, clen);
+    }
+    return false;
+}
 
 // Creates an RSA public key. Two large prime numbers p and q, their product
 // n, and the public exponent e.
@@ -11,20 +75,35 @@
 // q: mpz_t: Prime number to be generated
 // n: mpz_t: n = pq
 // e: mpz_t: Exponent
-// nbits: uint64_t: Minimum number of bits for n
+// nbits: uint64_t: Minimum number of bits for n, at least
+// 2 * RSA_MIN_PRIME_BITS
 // iters: uint64_t: Number of iterations to be used for primality test
+// nthreads: uint32_t: Number of threads to search for p and q with
 // Returns: void
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+void rsa_make_pub(
+    mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, uint32_t nthreads) {
     mpz_t tmp1, tmp2, tmp3, tmp4, lambda;
-    mpz_inits(tmp1, tmp2, tmp3, tmp4, lambda, NULL);
+    mpz_t pq[2];
+    mpz_inits(tmp1, tmp2, tmp3, tmp4, lambda, pq[0], pq[1], NULL);
 
     // Use a number in the interval [nbits/4, 3*nbits/4] as bit length for p,
-    // and the rest for q.
-    uint64_t p_len = nbits / 4 + (random() % nbits) / 2;
-    uint64_t q_len = nbits - p_len;
+    // and the rest for q. For small keys the interval is narrowed so that
+    // neither prime is shorter than RSA_MIN_PRIME_BITS; from 64 bits on it
+    // is left as it is.
+    uint64_t bits[2];
+    bits[0] = nbits / 4 + (randstate_u64() % nbits) / 2;
+    if (bits[0] < RSA_MIN_PRIME_BITS) {
+        bits[0] = RSA_MIN_PRIME_BITS;
+    } else if (bits[0] > nbits - RSA_MIN_PRIME_BITS) {
+        bits[0] = nbits - RSA_MIN_PRIME_BITS;
+    }
+    bits[1] = nbits - bits[0];
 
-    make_prime(p, p_len, iters);
-    make_prime(q, q_len, iters);
+    // p and q each come from their own random stream, so they are the same
+    // whether they are searched for one after the other or in parallel.
+    make_primes(pq, bits, 2, iters, nthreads);
+    mpz_set(p, pq[0]);
+    mpz_set(q, pq[1]);
 
     // Set tmp1 to p-1 and tmp2 to q-1
     mpz_sub_ui(tmp1, p, 1);
@@ -39,23 +118,118 @@ void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t i
     // lambda = lcm(p-1,q-1) = product/gcd
     mpz_fdiv_q(lambda, tmp3, tmp4);
 
-    mpz_urandomb(tmp1, state, nbits);
+    randstate_urandomb(tmp1, nbits);
     gcd(tmp2, tmp1, lambda);
 
     // Loop till a random number of size around nbits is found that's coprime
     // with lambda. This number is the exponent.
     // while (! mpz_cmp_ui(tmp2, 1) || mpz_even_p(tmp1)) {
     while (mpz_cmp_ui(tmp2, 1)) {
-        mpz_urandomb(tmp1, state, nbits);
+        randstate_urandomb(tmp1, nbits);
         gcd(tmp2, tmp1, lambda);
     }
     mpz_set(e, tmp1);
     mpz_mul(n, p, q);
 
-    mpz_clears(tmp1, tmp2, tmp3, tmp4, lambda, NULL);
+    mpz_clears(tmp1, tmp2, tmp3, tmp4, lambda, pq[0], pq[1], NULL);
     return;
 }
 
+// Computes lambda = lcm(p_1 - 1, ..., p_k - 1), the Carmichael function of
+// the product of the given primes.
+//
+// Input parameters:
+// lambda: mpz_t: The result is stored here
+// primes: mpz_t[]: Prime factors
+// count: uint32_t: Number of primes
+// Returns: void
+static void rsa_lambda(mpz_t lambda, mpz_t primes[], uint32_t count) {
+    mpz_t tmp1, tmp2;
+    mpz_inits(tmp1, tmp2, NULL);
+
+    mpz_set_ui(lambda, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        // lambda = lcm(lambda, p-1) = lambda * (p-1) / gcd(lambda, p-1)
+        mpz_sub_ui(tmp1, primes[i], 1);
+        gcd(tmp2, lambda, tmp1);
+        mpz_mul(lambda, lambda, tmp1);
+        mpz_fdiv_q(lambda, lambda, tmp2);
+    }
+
+    mpz_clears(tmp1, tmp2, NULL);
+}
+
+// Returns the size of the i-th of count primes for an nbits modulus. nbits
+// is split evenly, and the last prime takes whatever is left over.
+//
+// Input parameters:
+// nbits: uint64_t: Minimum number of bits for n
+// count: uint32_t: Number of primes
+// i: uint32_t: Index of the prime
+// Returns: uint64_t: Number of bits of the i-th prime
+uint64_t rsa_prime_bits(uint64_t nbits, uint32_t count, uint32_t i) {
+    uint64_t len = nbits / count;
+    return (i == count - 1) ? nbits - len * (count - 1) : len;
+}
+
+// Creates a multi-prime RSA public key. count distinct primes of about
+// nbits/count bits each, their product n, and the public exponent e.
+// Smaller primes are much cheaper to find, and let decryption work modulo
+// each prime separately (see rsa_decrypt_crt). Any primes[i] that is
+// non-zero on entry (e.g. taken from a prime pool) is used as is; the
+// others are generated, in parallel on up to nthreads threads.
+//
+// Input parameters:
+// primes: mpz_t[]: count prime numbers to be generated
+// count: uint32_t: Number of primes, at most RSA_MAX_PRIMES
+// n: mpz_t: n = product of the primes
+// e: mpz_t: Exponent
+// nbits: uint64_t: Minimum number of bits for n
+// iters: uint64_t: Number of iterations to be used for primality test
+// nthreads: uint32_t: Number of threads to search for the primes with
+// Returns: void
+void rsa_make_pub_multi(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint32_t nthreads) {
+    uint64_t bits[RSA_MAX_PRIMES];
+    mpz_t tmp1, tmp2, lambda;
+    mpz_inits(tmp1, tmp2, lambda, NULL);
+
+    for (uint32_t i = 0; i < count; i++) {
+        bits[i] = rsa_prime_bits(nbits, count, i);
+    }
+    make_primes(primes, bits, count, iters, nthreads);
+
+    mpz_set_ui(n, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        bool dup = !mpz_sgn(primes[i]);
+
+        // The primes must be distinct, otherwise n is not square-free.
+        for (uint32_t j = 0; j < i; j++) {
+            dup = dup || !mpz_cmp(primes[i], primes[j]);
+        }
+        while (dup) {
+            make_prime(primes[i], rsa_prime_bits(nbits, count, i), iters);
+            dup = false;
+            for (uint32_t j = 0; j < i; j++) {
+                dup = dup || !mpz_cmp(primes[i], primes[j]);
+            }
+        }
+        mpz_mul(n, n, primes[i]);
+    }
+
+    rsa_lambda(lambda, primes, count);
+
+    // Loop till a random number of size around nbits is found that's coprime
+    // with lambda. This number is the exponent.
+    do {
+        randstate_urandomb(tmp1, nbits);
+        gcd(tmp2, tmp1, lambda);
+    } while (mpz_cmp_ui(tmp2, 1));
+    mpz_set(e, tmp1);
+
+    mpz_clears(tmp1, tmp2, lambda, NULL);
+}
+
 // Writes a public RSA key to pbfile. n, e, and s are written as hexstrings
 // in that order.
 //
@@ -64,9 +238,9 @@ void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t i
 // username: char[]
 // pbfile: FILE *: File pointer to the public key file
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
-    gmp_fprintf(pbfile, "%Zx\n", n);
-    gmp_fprintf(pbfile, "%Zx\n", e);
-    gmp_fprintf(pbfile, "%Zx\n", s);
+    hex_write_mpz(pbfile, n);
+    hex_write_mpz(pbfile, e);
+    hex_write_mpz(pbfile, s);
     fprintf(pbfile, "%s\n", username);
 }
 
@@ -77,9 +251,9 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
 // username: char[]
 // pbfile: FILE *: File pointer to the public key file
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
-    gmp_fscanf(pbfile, "%Zx", n);
-    gmp_fscanf(pbfile, "%Zx", e);
-    gmp_fscanf(pbfile, "%Zx", s);
+    hex_read_mpz(pbfile, n);
+    hex_read_mpz(pbfile, e);
+    hex_read_mpz(pbfile, s);
     fscanf(pbfile, "%s", username);
 }
 
@@ -113,6 +287,58 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
     mpz_clears(tmp1, tmp2, tmp3, tmp4, lambda, NULL);
 }
 
+// Given the primes of a multi-prime modulus and public exponent e, create
+// an RSA private key d.
+//
+// Input parameters:
+// d: mpz_t: Generated private key is saved here
+// e: mpz_t: Exponent
+// primes: mpz_t[]: Prime factors of the modulus
+// count: uint32_t: Number of primes
+// Returns: void
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t primes[], uint32_t count) {
+    mpz_t lambda;
+    mpz_init(lambda);
+
+    rsa_lambda(lambda, primes, count);
+
+    // Private key = inverse of e modulo lambda(n)
+    mod_inverse(d, e, lambda);
+
+    mpz_clear(lambda);
+}
+
+// Picks count exponents for keys that share a modulus, for use with
+// rsa_decrypt_batch. These are the smallest odd primes that are coprime
+// with lambda(n), and so are distinct and pairwise coprime.
+//
+// Input parameters:
+// e: mpz_t[]: count exponents to be generated
+// count: uint32_t: Number of exponents
+// primes: mpz_t[]: Prime factors of the modulus
+// nprimes: uint32_t: Number of primes
+// Returns: void
+void rsa_make_batch_exponents(mpz_t e[], uint32_t count, mpz_t primes[], uint32_t nprimes) {
+    mpz_t lambda;
+    mpz_init(lambda);
+
+    rsa_lambda(lambda, primes, nprimes);
+
+    // The candidates are small, so trial division is enough to find the
+    // primes among them.
+    for (uint64_t cand = 3, i = 0; i < count; cand += 2) {
+        bool prime = true;
+        for (uint64_t f = 3; prime && f * f <= cand; f += 2) {
+            prime = cand % f != 0;
+        }
+        if (prime && !mpz_divisible_ui_p(lambda, cand)) {
+            mpz_set_ui(e[i++], cand);
+        }
+    }
+
+    mpz_clear(lambda);
+}
+
 // Writes a private RSA key to pvfile. n and d are written as hexstrings
 // in that order.
 //
@@ -121,8 +347,8 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
 // pvfile: FILE *: File pointer to the private key file
 // Returns: void
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
-    gmp_fprintf(pvfile, "%Zx\n", n);
-    gmp_fprintf(pvfile, "%Zx\n", d);
+    hex_write_mpz(pvfile, n);
+    hex_write_mpz(pvfile, d);
 }
 
 // Reads a private RSA key from pvfile.
@@ -132,8 +358,121 @@ void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
 // pvfile: FILE *: File pointer of the file to be read
 // Returns: void
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
-    gmp_fscanf(pvfile, "%Zx", n);
-    gmp_fscanf(pvfile, "%Zx", d);
+    hex_read_mpz(pvfile, n);
+    hex_read_mpz(pvfile, d);
+}
+
+// Appends the prime factors of the modulus to a private key file, after
+// the n and d written by rsa_write_priv. The number of primes comes first,
+// followed by the primes, all as hexstrings. Readers that only know about
+// n and d ignore this section.
+//
+// Input parameters:
+// primes: mpz_t[]: Prime factors of the modulus
+// count: uint32_t: Number of primes
+// pvfile: FILE *: File pointer to the private key file
+// Returns: void
+void rsa_write_priv_primes(mpz_t primes[], uint32_t count, FILE *pvfile) {
+    fprintf(pvfile, "%x\n", count);
+    for (uint32_t i = 0; i < count; i++) {
+        hex_write_mpz(pvfile, primes[i]);
+    }
+}
+
+// Initializes the variables of a CRT key. The key starts out empty.
+//
+// Input parameters:
+// crt: rsa_crt_t *: Key to initialize
+// Returns: void
+void rsa_crt_init(rsa_crt_t *crt) {
+    crt->count = 0;
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES; i++) {
+        mpz_inits(crt->p[i], crt->dp[i], crt->coeff[i], NULL);
+    }
+}
+
+// Clears and frees the memory used by a CRT key.
+//
+// Input parameters:
+// crt: rsa_crt_t *: Key to clear
+// Returns: void
+void rsa_crt_clear(rsa_crt_t *crt) {
+    for (uint32_t i = 0; i < RSA_MAX_PRIMES; i++) {
+        mpz_clears(crt->p[i], crt->dp[i], crt->coeff[i], NULL);
+    }
+    crt->count = 0;
+}
+
+// Fills in a CRT key from the prime factors of the modulus and the private
+// key d, precomputing the reduced exponents and recombination coefficients.
+//
+// Input parameters:
+// crt: rsa_crt_t *: Initialized CRT key to fill in
+// primes: mpz_t[]: Prime factors of the modulus (may be crt->p itself)
+// count: uint32_t: Number of primes, 2 to RSA_MAX_PRIMES
+// d: mpz_t: Private key
+// Returns: void
+void rsa_crt_set(rsa_crt_t *crt, mpz_t primes[], uint32_t count, mpz_t d) {
+    mpz_t prod, tmp;
+    mpz_inits(prod, tmp, NULL);
+
+    mpz_set_ui(prod, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_set(crt->p[i], primes[i]);
+
+        // dp = d mod (p-1)
+        mpz_sub_ui(tmp, crt->p[i], 1);
+        mpz_mod(crt->dp[i], d, tmp);
+
+        // coeff = (p_0 * ... * p_(i-1))^-1 mod p_i, used to recombine
+        mpz_mod(tmp, prod, crt->p[i]);
+        mod_inverse(crt->coeff[i], tmp, crt->p[i]);
+
+        mpz_mul(prod, prod, crt->p[i]);
+    }
+    crt->count = count;
+
+    mpz_clears(prod, tmp, NULL);
+}
+
+// Reads the prime factors that follow n and d in a private key file (see
+// rsa_write_priv_primes) into a CRT key. Must be called after rsa_read_priv
+// on the same file. Each factor is checked with RSA_CHECK_ITERS rounds of
+// Miller-Rabin, so a random stream must be bound to the calling thread.
+//
+// Input parameters:
+// crt: rsa_crt_t *: Initialized CRT key, filled in on success
+// n, d: mpz_t: Modulus and private key read by rsa_read_priv
+// pvfile: FILE *: File pointer of the file to be read
+// Returns: bool: True if valid primes were found. False for a key without
+// primes, or if they are not prime or do not multiply to n; crt->count is
+// then 0.
+bool rsa_read_priv_primes(rsa_crt_t *crt, mpz_t n, mpz_t d, FILE *pvfile) {
+    unsigned int count;
+    mpz_t prod;
+
+    crt->count = 0;
+    if (fscanf(pvfile, "%x", &count) != 1 || count < 2 || count > RSA_MAX_PRIMES) {
+        return false;
+    }
+
+    mpz_init_set_ui(prod, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!hex_read_mpz(pvfile, crt->p[i]) || !is_prime(crt->p[i], RSA_CHECK_ITERS)) {
+            mpz_clear(prod);
+            return false;
+        }
+        mpz_mul(prod, prod, crt->p[i]);
+    }
+
+    if (mpz_cmp(prod, n)) {
+        mpz_clear(prod);
+        return false;
+    }
+
+    rsa_crt_set(crt, crt->p, count, d);
+    mpz_clear(prod);
+    return true;
 }
 
 // Performs RSA encryption, computing ciphertext c by encrypting message
@@ -156,19 +495,22 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
 // outfile: FILE *: Encrypted output file
 // n: mpz_t: Modulus
 // e: mpz_t: Exponent
-// Returns: void
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+// Returns: bool: False if infile could not be read or outfile written
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
     size_t j;
     mpz_t m, c;
     mpz_inits(m, c, NULL);
     uint64_t k;
-    uint8_t *buf;
+    uint8_t *buf, *cbuf;
+    bcache_t *cache = rsa_block_cache_bytes > 0 ? bcache_create(rsa_block_cache_bytes) : NULL;
+    uint64_t hits = 0, lookups = 0;
 
     // Calculate the block size k = floor(log_2(n)-1/8)
     k = (mpz_sizeinbase(n, 2) - 1) / 8;
 
     // Allocate array to hold k bytes. Typecast it to uint8_t *.
     buf = (uint8_t *) calloc(k, 1);
+    cbuf = (uint8_t *) malloc(k + 2);
 
     // Set the 0th byte of the block to 0xFF
     buf[0] = 0xFF;
@@ -177,14 +519,217 @@ void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
         // Read at most k-1 bytes in the buffer, starting from position 1
         j = fread(buf + 1, 1, k - 1, infile);
 
-        // Import to an mpz_t variable, encrypt, and write to outfile as hex
-        mpz_import(m, j + 1, 1, 1, 1, 0, buf);
-        rsa_encrypt(c, m, e, n);
-        gmp_fprintf(outfile, "%Zx\n", c);
+        // Encrypt (or find in the cache), and write to outfile as hex
+        hits += rsa_encrypt_block(c, m, buf, j + 1, e, n, cache, cbuf);
+        lookups++;
+        hex_write_mpz(outfile, c);
+        if (ferror(infile)) {
+            break;
+        }
     }
 
+    if (cache != NULL) {
+        atomic_fetch_add(&rsa_block_cache_hits, hits);
+        atomic_fetch_add(&rsa_block_cache_lookups, lookups);
+        bcache_delete(cache);
+    }
     mpz_clears(m, c, NULL);
+    free(cbuf);
     free(buf);
+    return !ferror(infile) && !ferror(outfile);
+}
+
+// Size of the plaintext chunks rsa_encrypt_file_multi reads at a time
+#define RSA_MULTI_CHUNK (1 << 20)
+
+// State of one recipient in rsa_encrypt_file_multi. Each recipient has its
+// own block size, so it carries its own partial block from chunk to chunk.
+typedef struct {
+    mpz_ptr n;
+    mpz_ptr e;
+    FILE *outfile;
+    uint64_t k; // Block size
+    uint8_t *buf; // 0xFF followed by up to k - 1 plaintext bytes
+    size_t used; // Number of plaintext bytes in buf
+    const uint8_t *chunk; // Plaintext to encrypt in this round
+    size_t len;
+    bcache_t *cache; // Block cache, or NULL
+    uint8_t *cbuf; // Scratch buffer for the cache
+    uint64_t hits;
+    uint64_t lookups;
+} rsa_recipient_t;
+
+// Thread function of rsa_encrypt_file_multi. Encrypts every block that the
+// current chunk completes for one recipient, and keeps the remainder.
+//
+// Input parameters:
+// arg: void *: rsa_recipient_t * of the recipient
+// Returns: void *: NULL
+static void *rsa_encrypt_recipient(void *arg) {
+    rsa_recipient_t *r = arg;
+    const uint8_t *p = r->chunk;
+    size_t left = r->len;
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+
+    while (left > 0) {
+        size_t take = r->k - 1 - r->used < left ? r->k - 1 - r->used : left;
+        memcpy(r->buf + 1 + r->used, p, take);
+        r->used += take;
+        p += take;
+        left -= take;
+        if (r->used == r->k - 1) {
+            r->hits += rsa_encrypt_block(c, m, r->buf, r->k, r->e, r->n, r->cache, r->cbuf);
+            r->lookups++;
+            hex_write_mpz(r->outfile, c);
+            r->used = 0;
+        }
+    }
+
+    mpz_clears(m, c, NULL);
+    return NULL;
+}
+
+// Encrypts the contents of infile for several recipients, writing the
+// ciphertext for recipient i to outfiles[i]. The input is read only once,
+// and each chunk of it is encrypted for all recipients in parallel. Every
+// output is identical to what rsa_encrypt_file would write for that key.
+//
+// Input parameters:
+// infile: FILE *: Input file to be encrypted
+// outfiles: FILE *[]: Encrypted output file of each recipient
+// n: mpz_t[]: Modulus of each recipient
+// e: mpz_t[]: Exponent of each recipient
+// count: uint32_t: Number of recipients
+// Returns: bool: False if infile could not be read or an output written
+bool rsa_encrypt_file_multi(FILE *infile, FILE *outfiles[], mpz_t n[], mpz_t e[], uint32_t count) {
+    rsa_recipient_t *rcpt = (rsa_recipient_t *) calloc(count, sizeof(rsa_recipient_t));
+    pthread_t *threads = (pthread_t *) calloc(count, sizeof(pthread_t));
+    bool *started = (bool *) calloc(count, sizeof(bool));
+    uint8_t *chunk = (uint8_t *) malloc(RSA_MULTI_CHUNK);
+    size_t len;
+    bool ok = true;
+    mpz_t m, c;
+
+    for (uint32_t i = 0; i < count; i++) {
+        rcpt[i].n = n[i];
+        rcpt[i].e = e[i];
+        rcpt[i].outfile = outfiles[i];
+        rcpt[i].k = (mpz_sizeinbase(n[i], 2) - 1) / 8;
+        rcpt[i].buf = (uint8_t *) calloc(rcpt[i].k, 1);
+        rcpt[i].buf[0] = 0xFF;
+        rcpt[i].chunk = chunk;
+        rcpt[i].cbuf = (uint8_t *) malloc(rcpt[i].k + 2);
+        if (rsa_block_cache_bytes > 0) {
+            rcpt[i].cache = bcache_create(rsa_block_cache_bytes);
+        }
+    }
+
+    while ((len = fread(chunk, 1, RSA_MULTI_CHUNK, infile)) > 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            rcpt[i].len = len;
+        }
+        // The calling thread takes the first recipient itself.
+        for (uint32_t i = 1; i < count; i++) {
+            started[i] = pthread_create(&threads[i], NULL, rsa_encrypt_recipient, &rcpt[i]) == 0;
+            if (!started[i]) {
+                rsa_encrypt_recipient(&rcpt[i]);
+            }
+        }
+        rsa_encrypt_recipient(&rcpt[0]);
+        for (uint32_t i = 1; i < count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+    }
+
+    // Like rsa_encrypt_file, always finish with the partial (possibly empty)
+    // last block.
+    mpz_inits(m, c, NULL);
+    for (uint32_t i = 0; i < count; i++) {
+        rcpt[i].hits += rsa_encrypt_block(
+            c, m, rcpt[i].buf, rcpt[i].used + 1, e[i], n[i], rcpt[i].cache, rcpt[i].cbuf);
+        rcpt[i].lookups++;
+        hex_write_mpz(outfiles[i], c);
+        if (rcpt[i].cache != NULL) {
+            atomic_fetch_add(&rsa_block_cache_hits, rcpt[i].hits);
+            atomic_fetch_add(&rsa_block_cache_lookups, rcpt[i].lookups);
+            bcache_delete(rcpt[i].cache);
+        }
+        free(rcpt[i].cbuf);
+        free(rcpt[i].buf);
+        ok = ok && !ferror(outfiles[i]);
+    }
+
+    mpz_clears(m, c, NULL);
+    free(chunk);
+    free(started);
+    free(threads);
+    free(rcpt);
+    return ok && !ferror(infile);
+}
+
+// Compresses the contents of infile and encrypts the result, writing it to
+// outfile. The ciphertext starts with a header line, which tells
+// rsa_decrypt_file to decompress after decrypting. Compression cuts the
+// number of blocks, and hence of rsa_encrypt calls, by the compression ratio.
+//
+// Input parameters:
+// infile: FILE *: Input file to be encrypted
+// outfile: FILE *: Encrypted output file
+// n: mpz_t: Modulus
+// e: mpz_t: Exponent
+// Returns: bool: True in case of success
+bool rsa_encrypt_file_lz(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+    FILE *tmp;
+    bool ok;
+
+    if ((tmp = tmpfile()) == NULL || !lz_compress_file(infile, tmp)) {
+        printf("Could not compress the input file\n");
+        if (tmp != NULL) {
+            fclose(tmp);
+        }
+        return false;
+    }
+    rewind(tmp);
+
+    fprintf(outfile, "%s\n", RSA_LZ_HEADER);
+    ok = rsa_encrypt_file(tmp, outfile, n, e);
+    fclose(tmp);
+    return ok;
+}
+
+// Compresses the contents of infile once and encrypts the result for
+// several recipients, as rsa_encrypt_file_multi does.
+//
+// Input parameters:
+// infile: FILE *: Input file to be encrypted
+// outfiles: FILE *[]: Encrypted output file of each recipient
+// n: mpz_t[]: Modulus of each recipient
+// e: mpz_t[]: Exponent of each recipient
+// count: uint32_t: Number of recipients
+// Returns: bool: True in case of success
+bool rsa_encrypt_file_multi_lz(
+    FILE *infile, FILE *outfiles[], mpz_t n[], mpz_t e[], uint32_t count) {
+    FILE *tmp;
+    bool ok;
+
+    if ((tmp = tmpfile()) == NULL || !lz_compress_file(infile, tmp)) {
+        printf("Could not compress the input file\n");
+        if (tmp != NULL) {
+            fclose(tmp);
+        }
+        return false;
+    }
+    rewind(tmp);
+
+    for (uint32_t i = 0; i < count; i++) {
+        fprintf(outfiles[i], "%s\n", RSA_LZ_HEADER);
+    }
+    ok = rsa_encrypt_file_multi(tmp, outfiles, n, e, count);
+    fclose(tmp);
+    return ok;
 }
 
 // Performs RSA decryption, computing message m by decrypting ciphertext c
@@ -199,41 +744,465 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
     pow_mod(m, c, d, n);
 }
 
-// Decrypts the contents of infile, writing the decrypted contents to outfile.
+// Performs RSA decryption using the Chinese remainder theorem. The message
+// is computed modulo each prime with the reduced exponent d mod (p-1), on
+// operands a fraction of the size of n, and the results are recombined with
+// Garner's algorithm.
+//
+// Input parameters:
+// m: mpz_t: Decrypted message
+// c: mpz_t: Ciphertext to be decrypted
+// crt: rsa_crt_t *: Private key with its prime factors
+// Returns: void
+void rsa_decrypt_crt(mpz_t m, mpz_t c, rsa_crt_t *crt) {
+    mpz_t r, mi, ci, prod;
+    mpz_inits(r, mi, ci, prod, NULL);
+
+    mpz_mod(ci, c, crt->p[0]);
+    pow_mod(r, ci, crt->dp[0], crt->p[0]);
+    mpz_set(prod, crt->p[0]);
+
+    for (uint32_t i = 1; i < crt->count; i++) {
+        mpz_mod(ci, c, crt->p[i]);
+        pow_mod(mi, ci, crt->dp[i], crt->p[i]);
+
+        // r += prod * ((mi - r) * coeff mod p_i), so that r is now correct
+        // modulo p_0 * ... * p_i as well.
+        mpz_sub(mi, mi, r);
+        mpz_mul(mi, mi, crt->coeff[i]);
+        mpz_mod(mi, mi, crt->p[i]);
+        mpz_addmul(r, mi, prod);
+        mpz_mul(prod, prod, crt->p[i]);
+    }
+
+    mpz_set(m, r);
+    mpz_clears(r, mi, ci, prod, NULL);
+}
+
+// Node of the tree used by rsa_decrypt_batch. For the ciphertexts c_i under
+// the node, E is the product of their exponents e_i, and v is the product of
+// c_i^(E/e_i) mod n. v is therefore M^E, where M is the product of the
+// corresponding messages.
+typedef struct {
+    mpz_t v;
+    mpz_t E;
+} rsa_batch_node_t;
+
+// Percolates the ciphertexts c[lo..hi) up the tree, filling in node k and
+// its descendants (the children of node k are 2k+1 and 2k+2).
+//
+// Input parameters:
+// tree: rsa_batch_node_t[]: The tree
+// k: uint32_t: Index of the node
+// lo, hi: uint32_t: Range of ciphertexts under the node
+// c: mpz_t[]: Ciphertexts
+// e: mpz_t[]: Public exponent of each ciphertext
+// n: mpz_t: Modulus
+// Returns: bool: False if the exponents are not pairwise coprime
+static bool rsa_batch_up(rsa_batch_node_t tree[], uint32_t k, uint32_t lo, uint32_t hi, mpz_t c[],
+    mpz_t e[], mpz_t n) {
+    rsa_batch_node_t *node = &tree[k], *l = &tree[2 * k + 1], *r = &tree[2 * k + 2];
+    uint32_t mid = lo + (hi - lo) / 2;
+    bool ok;
+    mpz_t tmp;
+
+    if (hi - lo == 1) {
+        mpz_mod(node->v, c[lo], n);
+        mpz_set(node->E, e[lo]);
+        return true;
+    }
+    if (!rsa_batch_up(tree, 2 * k + 1, lo, mid, c, e, n)
+        || !rsa_batch_up(tree, 2 * k + 2, mid, hi, c, e, n)) {
+        return false;
+    }
+
+    // v = v_l^E_r * v_r^E_l, E = E_l * E_r
+    mpz_init(tmp);
+    gcd(tmp, l->E, r->E);
+    ok = mpz_cmp_ui(tmp, 1) == 0;
+    if (ok) {
+        pow_mod(node->v, l->v, r->E, n);
+        pow_mod(tmp, r->v, l->E, n);
+        mpz_mul(node->v, node->v, tmp);
+        mpz_mod(node->v, node->v, n);
+        mpz_mul(node->E, l->E, r->E);
+    }
+    mpz_clear(tmp);
+    return ok;
+}
+
+// Percolates the product of messages M under node k down the tree, storing
+// the individual messages in m[lo..hi).
+//
+// Input parameters:
+// tree: rsa_batch_node_t[]: The tree, filled in by rsa_batch_up
+// k: uint32_t: Index of the node
+// lo, hi: uint32_t: Range of messages under the node
+// M: mpz_t: Product of the messages under the node. Clobbered.
+// m: mpz_t[]: Decrypted messages
+// n: mpz_t: Modulus
+// Returns: bool: False if an inverse modulo n does not exist
+static bool rsa_batch_down(
+    rsa_batch_node_t tree[], uint32_t k, uint32_t lo, uint32_t hi, mpz_t M, mpz_t m[], mpz_t n) {
+    rsa_batch_node_t *l = &tree[2 * k + 1], *r = &tree[2 * k + 2];
+    uint32_t mid = lo + (hi - lo) / 2;
+    mpz_t a, b, X, Mr, tmp;
+    bool ok;
+
+    if (hi - lo == 1) {
+        mpz_set(m[lo], M);
+        return true;
+    }
+    mpz_inits(a, b, X, Mr, tmp, NULL);
+
+    // With X = 0 mod E_l and X = 1 mod E_r, M^X = M_l^X * M_r^X
+    //   = v_l^(X/E_l) * M_r * v_r^((X-1)/E_r),
+    // which gives M_r, and then M_l = M / M_r.
+    mpz_mod(tmp, l->E, r->E);
+    mod_inverse(a, tmp, r->E);
+    mpz_mul(X, a, l->E);
+    mpz_sub_ui(b, X, 1);
+    mpz_divexact(b, b, r->E);
+
+    pow_mod(Mr, M, X, n);
+    pow_mod(tmp, l->v, a, n);
+    pow_mod(X, r->v, b, n);
+    mpz_mul(tmp, tmp, X);
+    mpz_mod(tmp, tmp, n);
+
+    gcd(X, tmp, n);
+    ok = mpz_cmp_ui(X, 1) == 0;
+    if (ok) {
+        mod_inverse(X, tmp, n);
+        mpz_mul(Mr, Mr, X);
+        mpz_mod(Mr, Mr, n);
+
+        gcd(X, Mr, n);
+        ok = mpz_cmp_ui(X, 1) == 0;
+    }
+    if (ok) {
+        mod_inverse(X, Mr, n);
+        mpz_mul(M, M, X);
+        mpz_mod(M, M, n);
+        ok = rsa_batch_down(tree, 2 * k + 1, lo, mid, M, m, n)
+             && rsa_batch_down(tree, 2 * k + 2, mid, hi, Mr, m, n);
+    }
+
+    mpz_clears(a, b, X, Mr, tmp, NULL);
+    return ok;
+}
+
+// Decrypts count ciphertexts at once with Fiat's batch RSA. The ciphertexts
+// are for keys that share the modulus n but have distinct small prime
+// exponents e_i (see rsa_make_batch_exponents). Their combination is
+// decrypted with a single full size exponentiation, instead of one per
+// ciphertext, and the individual messages are then split back out using
+// only small exponents.
+//
+// Input parameters:
+// m: mpz_t[]: Decrypted messages
+// c: mpz_t[]: Ciphertexts to be decrypted
+// e: mpz_t[]: Public exponent each ciphertext was encrypted with
+// count: uint32_t: Number of ciphertexts
+// n: mpz_t: Public modulus
+// crt: rsa_crt_t *: Prime factors of n
+// Returns: bool: True in case of success. False if crt holds no primes, the
+// exponents are not pairwise coprime, or one is not coprime with lambda(n).
+bool rsa_decrypt_batch(mpz_t m[], mpz_t c[], mpz_t e[], uint32_t count, mpz_t n, rsa_crt_t *crt) {
+    rsa_batch_node_t *tree;
+    rsa_crt_t root;
+    mpz_t lambda, dE, M;
+    uint32_t size;
+    bool ok;
+
+    if (count == 0 || crt->count == 0) {
+        return false;
+    }
+
+    // A tree over count leaves, numbered as a binary heap, has fewer than
+    // 4 * count nodes.
+    size = 4 * count;
+    tree = (rsa_batch_node_t *) malloc(size * sizeof(rsa_batch_node_t));
+    for (uint32_t i = 0; i < size; i++) {
+        mpz_inits(tree[i].v, tree[i].E, NULL);
+    }
+    mpz_inits(lambda, dE, M, NULL);
+    rsa_crt_init(&root);
+
+    ok = rsa_batch_up(tree, 0, 0, count, c, e, n);
+
+    // M = v^(1/E): the only full size exponentiation, done with the CRT
+    // using the private exponent 1/E mod lambda(n).
+    if (ok) {
+        rsa_lambda(lambda, crt->p, crt->count);
+        gcd(dE, tree[0].E, lambda);
+        ok = mpz_cmp_ui(dE, 1) == 0;
+    }
+    if (ok) {
+        mpz_mod(dE, tree[0].E, lambda);
+        mod_inverse(dE, dE, lambda);
+        rsa_crt_set(&root, crt->p, crt->count, dE);
+        rsa_decrypt_crt(M, tree[0].v, &root);
+        ok = rsa_batch_down(tree, 0, 0, count, M, m, n);
+    }
+
+    rsa_crt_clear(&root);
+    mpz_clears(lambda, dE, M, NULL);
+    for (uint32_t i = 0; i < size; i++) {
+        mpz_clears(tree[i].v, tree[i].E, NULL);
+    }
+    free(tree);
+    return ok;
+}
+
+// Decrypts the ciphertext blocks in infile, writing the decrypted contents
+// to outfile.
 //
 // Input parameters:
 // infile: FILE *: Input file containing the ciphertext
 // outfile: FILE *: Output file that will contain the plain text
 // n: mpz_t: Modulus
 // d: mpz_t: Private key
-// Returns: void
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+// crt: rsa_crt_t *: Prime factors for CRT decryption, or NULL
+// Returns: bool: False if a line is not a hexstring, a block does not
+// decrypt to a 0xFF prefixed message (wrong key or corrupted ciphertext),
+// or outfile could not be written
+static bool rsa_decrypt_blocks(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt) {
     uint64_t k = 8;
-    uint8_t *buf;
+    uint8_t *buf, *cbuf;
     uint64_t j;
+    size_t clen;
     mpz_t c, m;
     mpz_inits(c, m, NULL);
+    bcache_t *cache = rsa_block_cache_bytes > 0 ? bcache_create(rsa_block_cache_bytes) : NULL;
+    const uint8_t *hit;
+    uint64_t hits = 0, lookups = 0;
+    bool ok = true;
 
     // Calculate the block size k = floor(log_2(n)-1/8)
     k = (mpz_sizeinbase(n, 2) - 1) / 8;
     // Allocate array to hold k bytes. Typecast it to uint8_t *.
     buf = (uint8_t *) calloc(k, 1);
+    cbuf = (uint8_t *) malloc(k + 2);
 
     // Set the 0th byte of the block to 0xFF
     buf[0] = 0xFF;
 
-    // Scan in a hexstring to a variable c (for ciphertex)
-    gmp_fscanf(infile, "%Zx", c);
-
-    while (!feof(infile)) {
-        rsa_decrypt(m, c, d, n);
+    // Scan in one hexstring at a time to a variable c (for ciphertext)
+    while (hex_read_mpz(infile, c)) {
+        // Repeated ciphertext blocks decrypt to the same plaintext, which
+        // the cache holds without the 0xFF prefix. Anything larger than n
+        // is left to fail as before.
+        if (cache != NULL && mpz_cmp(c, n) < 0) {
+            mpz_export(cbuf, &clen, 1, 1, 1, 0, c);
+            lookups++;
+            if ((hit = bcache_get(cache, cbuf, clen, &j)) != NULL) {
+                fwrite(hit, 1, j, outfile);
+                hits++;
+                continue;
+            }
+        }
+        if (crt != NULL && crt->count > 0) {
+            rsa_decrypt_crt(m, c, crt);
+        } else {
+            rsa_decrypt(m, c, d, n);
+        }
         mpz_export(buf, &j, 1, 1, 1, 0, m);
+        if (j == 0 || j > k || buf[0] != 0xFF) {
+            printf("A ciphertext block did not decrypt to a valid message\n");
+            ok = false;
+            break;
+        }
         fwrite(buf + 1, 1, j - 1, outfile);
-        gmp_fscanf(infile, "%Zx", c);
+        if (cache != NULL && mpz_cmp(c, n) < 0) {
+            bcache_put(cache, cbuf, clen, buf + 1, j - 1);
+        }
+    }
+
+    // hex_read_mpz also stops at a line that is not a hexstring.
+    if (ok && (!feof(infile) || ferror(infile))) {
+        printf("The input file is not a valid ciphertext\n");
+        ok = false;
     }
 
+    if (cache != NULL) {
+        atomic_fetch_add(&rsa_block_cache_hits, hits);
+        atomic_fetch_add(&rsa_block_cache_lookups, lookups);
+        bcache_delete(cache);
+    }
     mpz_clears(c, m, NULL);
+    free(cbuf);
     free(buf);
+    return ok && !ferror(outfile);
+}
+
+// Decrypts the contents of infile, writing the decrypted contents to outfile.
+// If the ciphertext was produced by rsa_encrypt_file_lz, the plaintext is
+// decompressed after decryption.
+//
+// Input parameters:
+// infile: FILE *: Input file containing the ciphertext
+// outfile: FILE *: Output file that will contain the plain text
+// n: mpz_t: Modulus
+// d: mpz_t: Private key
+// Returns: bool: True in case of success
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+    return rsa_decrypt_file_crt(infile, outfile, n, d, NULL);
+}
+
+// Reads the header line of a ciphertext, if it has one.
+//
+// Input parameters:
+// infile: FILE *: Input file containing the ciphertext
+// lz: bool *: Set to true if the plaintext was compressed before encryption
+// Returns: bool: False if the header is not one rsa_encrypt_file_lz writes
+static bool rsa_read_header(FILE *infile, bool *lz) {
+    char header[16];
+    int ch;
+
+    // Skip any leading whitespace and peek at the first character. Hex digits
+    // mean a plain ciphertext; '#' starts a header line.
+    while ((ch = getc(infile)) != EOF && isspace(ch)) {
+    }
+    *lz = false;
+    if (ch != '#') {
+        if (ch != EOF) {
+            ungetc(ch, infile);
+        }
+        return true;
+    }
+
+    ungetc(ch, infile);
+    if (fgets(header, sizeof(header), infile) == NULL
+        || strcmp(header, RSA_LZ_HEADER "\n") != 0) {
+        printf("The input file has an unknown header\n");
+        return false;
+    }
+    *lz = true;
+    return true;
+}
+
+// Same as rsa_decrypt_file, but decrypts each block with rsa_decrypt_crt
+// when the prime factors of n are known.
+//
+// Input parameters:
+// infile: FILE *: Input file containing the ciphertext
+// outfile: FILE *: Output file that will contain the plain text
+// n: mpz_t: Modulus
+// d: mpz_t: Private key
+// crt: rsa_crt_t *: Prime factors of n, or NULL (or empty) to use d
+// Returns: bool: True in case of success
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt) {
+    FILE *tmp;
+    bool lz, ok;
+
+    if (!rsa_read_header(infile, &lz)) {
+        return false;
+    }
+    if (!lz) {
+        return rsa_decrypt_blocks(infile, outfile, n, d, crt);
+    }
+
+    if ((tmp = tmpfile()) == NULL) {
+        printf("Could not create a temporary file\n");
+        return false;
+    }
+    ok = rsa_decrypt_blocks(infile, tmp, n, d, crt);
+    rewind(tmp);
+    if (ok && !lz_decompress_file(tmp, outfile)) {
+        printf("The decrypted data could not be decompressed\n");
+        ok = false;
+    }
+    fclose(tmp);
+    return ok && !ferror(outfile);
+}
+
+// Decrypts count ciphertext files at once with rsa_decrypt_batch. File i
+// must have been encrypted with the key of exponent e[i], and all the keys
+// share the modulus n, as with the key sets keygen -E makes. The files are
+// read a block at a time in step, and each round of blocks is decrypted as
+// one batch. Files may have different lengths; those that run out simply
+// drop out of the later rounds.
+//
+// Input parameters:
+// infiles: FILE *[]: Input files containing the ciphertexts
+// outfiles: FILE *[]: Output files that will contain the plain texts
+// e: mpz_t[]: Public exponent each file was encrypted with
+// count: uint32_t: Number of files, at most RSA_MAX_BATCH_KEYS
+// n: mpz_t: Modulus
+// crt: rsa_crt_t *: Prime factors of n
+// Returns: bool: True in case of success
+bool rsa_decrypt_file_batch(
+    FILE *infiles[], FILE *outfiles[], mpz_t e[], uint32_t count, mpz_t n, rsa_crt_t *crt) {
+    FILE *dst[RSA_MAX_BATCH_KEYS];
+    bool lz[RSA_MAX_BATCH_KEYS], active[RSA_MAX_BATCH_KEYS];
+    uint32_t idx[RSA_MAX_BATCH_KEYS];
+    mpz_t c[RSA_MAX_BATCH_KEYS], m[RSA_MAX_BATCH_KEYS], eb[RSA_MAX_BATCH_KEYS];
+    uint64_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    uint8_t *buf = (uint8_t *) calloc(k, 1);
+    uint32_t live = count;
+    bool ok = true;
+    size_t j;
+
+    for (uint32_t i = 0; i < count; i++) {
+        mpz_inits(c[i], m[i], eb[i], NULL);
+        active[i] = ok = ok && rsa_read_header(infiles[i], &lz[i]);
+        dst[i] = outfiles[i];
+        if (ok && lz[i] && (dst[i] = tmpfile()) == NULL) {
+            printf("Could not create a temporary file\n");
+            ok = active[i] = false;
+        }
+    }
+
+    while (ok && live > 0) {
+        live = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (active[i] && (active[i] = hex_read_mpz(infiles[i], c[live]))) {
+                mpz_set(eb[live], e[i]);
+                idx[live++] = i;
+            }
+        }
+        if (live == 0) {
+            break;
+        }
+        if (!rsa_decrypt_batch(m, c, eb, live, n, crt)) {
+            printf("The ciphertexts could not be decrypted as a batch\n");
+            ok = false;
+            break;
+        }
+        for (uint32_t i = 0; ok && i < live; i++) {
+            mpz_export(buf, &j, 1, 1, 1, 0, m[i]);
+            if (j == 0 || j > k || buf[0] != 0xFF) {
+                printf("A ciphertext block did not decrypt to a valid message\n");
+                ok = false;
+                break;
+            }
+            fwrite(buf + 1, 1, j - 1, dst[idx[i]]);
+        }
+    }
+
+    // hex_read_mpz also stops at a line that is not a hexstring.
+    for (uint32_t i = 0; ok && i < count; i++) {
+        if (!feof(infiles[i]) || ferror(infiles[i])) {
+            printf("An input file is not a valid ciphertext\n");
+            ok = false;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (dst[i] != outfiles[i]) {
+            rewind(dst[i]);
+            if (ok && !lz_decompress_file(dst[i], outfiles[i])) {
+                printf("The decrypted data could not be decompressed\n");
+                ok = false;
+            }
+            fclose(dst[i]);
+        }
+        ok = ok && !ferror(outfiles[i]);
+        mpz_clears(c[i], m[i], eb[i], NULL);
+    }
+    free(buf);
+    return ok;
 }
 
 // Performs RSA signing
@@ -248,6 +1217,17 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
     pow_mod(s, m, d, n);
 }
 
+// Performs RSA signing using the Chinese remainder theorem
+//
+// Input parameters:
+// s: mpz_t: Signature that's produced
+// m: mpz_t: Message to be signed
+// crt: rsa_crt_t *: Private key with its prime factors
+// Returns: void
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_crt_t *crt) {
+    rsa_decrypt_crt(s, m, crt);
+}
+
 // Performs RSA verification
 //
 // Input parameters:
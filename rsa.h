@@ -5,7 +5,40 @@
 #include <stdio.h>
 #include <gmp.h>
 
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
+// Largest number of prime factors supported in a multi-prime modulus
+#define RSA_MAX_PRIMES 4
+
+// Largest number of keys in a batch key set (keygen -E, decrypt -E)
+#define RSA_MAX_BATCH_KEYS 64
+
+// Smallest prime size keygen accepts. Below this there are too few primes
+// of a given size to draw distinct ones from.
+#define RSA_MIN_PRIME_BITS 16
+
+// Miller-Rabin iterations used to check the primes read from a private key
+// before they are used for CRT decryption
+#define RSA_CHECK_ITERS 8
+
+// Prime factors of the modulus and the values derived from them that CRT
+// decryption needs. count is 0 when the private key carries no primes.
+typedef struct {
+    uint32_t count;
+    mpz_t p[RSA_MAX_PRIMES]; // Prime factors of n
+    mpz_t dp[RSA_MAX_PRIMES]; // d mod (p[i] - 1)
+    mpz_t coeff[RSA_MAX_PRIMES]; // Inverse of p[0] * ... * p[i - 1] modulo p[i]
+} rsa_crt_t;
+
+extern size_t rsa_block_cache_bytes;
+
+void rsa_block_cache_report(void);
+
+void rsa_make_pub(
+    mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, uint32_t nthreads);
+
+uint64_t rsa_prime_bits(uint64_t nbits, uint32_t count, uint32_t i);
+
+void rsa_make_pub_multi(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint32_t nthreads);
 
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
@@ -13,18 +46,50 @@ void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
 
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t primes[], uint32_t count);
+
+void rsa_make_batch_exponents(mpz_t e[], uint32_t count, mpz_t primes[], uint32_t nprimes);
+
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
+void rsa_write_priv_primes(mpz_t primes[], uint32_t count, FILE *pvfile);
+
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
+void rsa_crt_init(rsa_crt_t *crt);
+
+void rsa_crt_clear(rsa_crt_t *crt);
+
+void rsa_crt_set(rsa_crt_t *crt, mpz_t primes[], uint32_t count, mpz_t d);
+
+bool rsa_read_priv_primes(rsa_crt_t *crt, mpz_t n, mpz_t d, FILE *pvfile);
+
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+
+bool rsa_encrypt_file_lz(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+
+bool rsa_encrypt_file_multi(FILE *infile, FILE *outfiles[], mpz_t n[], mpz_t e[], uint32_t count);
+
+bool rsa_encrypt_file_multi_lz(
+    FILE *infile, FILE *outfiles[], mpz_t n[], mpz_t e[], uint32_t count);
 
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+void rsa_decrypt_crt(mpz_t m, mpz_t c, rsa_crt_t *crt);
+
+bool rsa_decrypt_batch(mpz_t m[], mpz_t c[], mpz_t e[], uint32_t count, mpz_t n, rsa_crt_t *crt);
+
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_crt_t *crt);
+
+bool rsa_decrypt_file_batch(
+    FILE *infiles[], FILE *outfiles[], mpz_t e[], uint32_t count, mpz_t n, rsa_crt_t *crt);
 
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_crt_t *crt);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
@@ -0,0 +1,124 @@
+#include "sha256.h"
+
+#include <string.h>
+
+// SHA-256 as specified in FIPS 180-4.
+
+#define ROTR(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+
+static const uint32_t k[64] = { 0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+    0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74,
+    0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3,
+    0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354,
+    0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+    0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3,
+    0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa,
+    0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+// Processes one 64 byte block.
+static void sha256_block(sha256_t *ctx, const uint8_t *p) {
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) p[4 * i] << 24) | ((uint32_t) p[4 * i + 1] << 16)
+               | ((uint32_t) p[4 * i + 2] << 8) | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+    e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+    for (int i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1;
+        d = c, c = b, b = a, a = t1 + t2;
+    }
+    ctx->h[0] += a, ctx->h[1] += b, ctx->h[2] += c, ctx->h[3] += d;
+    ctx->h[4] += e, ctx->h[5] += f, ctx->h[6] += g, ctx->h[7] += h;
+}
+
+// Starts a new hash.
+//
+// Input parameters:
+// ctx: sha256_t *: Hash state
+// Returns: void
+void sha256_init(sha256_t *ctx) {
+    static const uint32_t iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+        0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(ctx->h, iv, sizeof(iv));
+    ctx->len = 0;
+    ctx->used = 0;
+}
+
+// Adds n bytes to the hash.
+//
+// Input parameters:
+// ctx: sha256_t *: Hash state
+// data: const void *: Bytes to hash
+// n: size_t: Number of bytes
+// Returns: void
+void sha256_update(sha256_t *ctx, const void *data, size_t n) {
+    const uint8_t *p = data;
+
+    ctx->len += n;
+    if (ctx->used) {
+        size_t take = 64 - ctx->used < n ? 64 - ctx->used : n;
+        memcpy(ctx->buf + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        n -= take;
+        if (ctx->used < 64) {
+            return;
+        }
+        sha256_block(ctx, ctx->buf);
+        ctx->used = 0;
+    }
+    for (; n >= 64; p += 64, n -= 64) {
+        sha256_block(ctx, p);
+    }
+    memcpy(ctx->buf, p, n);
+    ctx->used = n;
+}
+
+// Finishes the hash.
+//
+// Input parameters:
+// ctx: sha256_t *: Hash state
+// digest: uint8_t[]: The 32 byte digest is stored here
+// Returns: void
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->len * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t padlen = (ctx->used < 56 ? 56 : 120) - ctx->used;
+
+    for (int i = 0; i < 8; i++) {
+        pad[padlen + i] = (uint8_t) (bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, pad, padlen + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->h[i] >> 24;
+        digest[4 * i + 1] = ctx->h[i] >> 16;
+        digest[4 * i + 2] = ctx->h[i] >> 8;
+        digest[4 * i + 3] = ctx->h[i];
+    }
+}
+
+// Hashes n bytes in one go.
+//
+// Input parameters:
+// digest: uint8_t[]: The 32 byte digest is stored here
+// data: const void *: Bytes to hash
+// n: size_t: Number of bytes
+// Returns: void
+void sha256(uint8_t digest[SHA256_DIGEST_SIZE], const void *data, size_t n) {
+    sha256_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, n);
+    sha256_final(&ctx, digest);
+}
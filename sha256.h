@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+    size_t used;
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+
+void sha256_update(sha256_t *ctx, const void *data, size_t n);
+
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void sha256(uint8_t digest[SHA256_DIGEST_SIZE], const void *data, size_t n);
@@ -0,0 +1,525 @@
+#include "shard.h"
+#include "hex.h"
+#include "sha256.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Sharded ciphertexts. shard_encrypt splits the plaintext into ranges and
+// encrypts each into its own file, <out>.<i>, which can be decrypted without
+// the others, by another process or on another host. <out>.manifest lists
+// the ranges:
+//
+//   RSASHARDS 1
+//   <count> <total size>
+//   <offset> <length> <sha256 of the plaintext range> <shard file>
+//   ...
+//
+// Shard files are named relative to the directory holding the manifest, so
+// the manifest and its shards can be moved together.
+
+#define SHARD_MAGIC "RSASHARDS 1"
+#define SHARD_MAX 4096
+#define SHARD_COPY (1 << 16)
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char path[PATH_MAX];
+} shard_t;
+
+typedef struct {
+    uint32_t count;
+    uint64_t total;
+    shard_t *shards;
+} shard_manifest_t;
+
+// Work shared by the threads of shard_encrypt and shard_merge. Shards are
+// handed out one at a time; step processes one of them.
+typedef struct shard_job {
+    shard_manifest_t *m;
+    char *infile; // Plaintext, when encrypting
+    int fd; // Plaintext, when merging
+    batch_fn fn;
+    void *ctx;
+    bool (*step)(struct shard_job *job, uint32_t i);
+    uint32_t next;
+    uint32_t failed;
+    pthread_mutex_t lock;
+} shard_job_t;
+
+// Copies up to len bytes from in to out, and hashes them.
+//
+// Input parameters:
+// in: FILE *: Stream to copy from
+// out: FILE *: Stream to copy to, or NULL to only hash
+// len: uint64_t: Largest number of bytes to copy
+// digest: uint8_t[]: SHA-256 of the copied bytes is stored here
+// Returns: uint64_t: Number of bytes copied
+static uint64_t shard_copy(FILE *in, FILE *out, uint64_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint8_t *buf = (uint8_t *) malloc(SHARD_COPY);
+    uint64_t done = 0;
+    sha256_t ctx;
+    size_t got;
+
+    sha256_init(&ctx);
+    while (done < len) {
+        size_t want = len - done < SHARD_COPY ? len - done : SHARD_COPY;
+        if ((got = fread(buf, 1, want, in)) == 0) {
+            break;
+        }
+        if (out != NULL && fwrite(buf, 1, got, out) != got) {
+            break;
+        }
+        sha256_update(&ctx, buf, got);
+        done += got;
+    }
+    sha256_final(&ctx, digest);
+
+    free(buf);
+    return done;
+}
+
+// Writes the rest of in to fd, starting at offset.
+//
+// Input parameters:
+// in: FILE *: Stream to copy from
+// fd: int: File to copy to
+// offset: uint64_t: Position in fd of the first byte
+// Returns: bool: True in case of success
+static bool shard_pwrite(FILE *in, int fd, uint64_t offset) {
+    uint8_t *buf = (uint8_t *) malloc(SHARD_COPY);
+    bool ok = true;
+    size_t got;
+
+    while (ok && (got = fread(buf, 1, SHARD_COPY, in)) > 0) {
+        for (size_t done = 0; ok && done < got;) {
+            ssize_t put = pwrite(fd, buf + done, got - done, offset);
+            ok = put > 0;
+            if (ok) {
+                done += put;
+                offset += put;
+            }
+        }
+    }
+
+    free(buf);
+    return ok && !ferror(in);
+}
+
+// Thread function of shard_run. Processes shards until none are left.
+//
+// Input parameters:
+// arg: void *: shard_job_t * shared by all the threads
+// Returns: void *: NULL
+static void *shard_worker(void *arg) {
+    shard_job_t *job = arg;
+    uint32_t failed = 0;
+    uint32_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->m->count) {
+            break;
+        }
+        if (!job->step(job, i)) {
+            failed++;
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->failed += failed;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// Applies job->step to every shard, using up to nthreads threads.
+//
+// Input parameters:
+// job: shard_job_t *: The work to do
+// nthreads: uint32_t: Number of worker threads
+// Returns: uint32_t: Number of shards that failed
+static uint32_t shard_run(shard_job_t *job, uint32_t nthreads) {
+    pthread_t *threads;
+
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    if (nthreads > job->m->count) {
+        nthreads = job->m->count;
+    }
+
+    job->next = 0;
+    job->failed = 0;
+    pthread_mutex_init(&job->lock, NULL);
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, shard_worker, job);
+    }
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job->lock);
+
+    return job->failed;
+}
+
+// Encrypts one range of the plaintext into its shard file.
+//
+// Input parameters:
+// job: shard_job_t *: The work being done
+// i: uint32_t: Index of the shard
+// Returns: bool: True in case of success
+static bool shard_encrypt_one(shard_job_t *job, uint32_t i) {
+    shard_t *s = &job->m->shards[i];
+    FILE *in, *tmp, *out;
+    bool ok;
+
+    if ((in = fopen(job->infile, "r")) == NULL) {
+        printf("Could not open %s\n", job->infile);
+        return false;
+    }
+    if ((tmp = tmpfile()) == NULL) {
+        printf("Could not create a temporary file for shard %u\n", i);
+        fclose(in);
+        return false;
+    }
+
+    // Each shard is encrypted from a copy of its range, so that the
+    // encryption function sees a stream that ends where the range does.
+    ok = fseeko(in, s->offset, SEEK_SET) == 0
+         && shard_copy(in, tmp, s->length, s->digest) == s->length;
+    fclose(in);
+    if (!ok) {
+        printf("Could not read shard %u of %s\n", i, job->infile);
+        fclose(tmp);
+        return false;
+    }
+    rewind(tmp);
+
+    if ((out = fopen(s->path, "w")) == NULL) {
+        printf("Could not create %s\n", s->path);
+        fclose(tmp);
+        return false;
+    }
+    if (!(ok = job->fn(tmp, out, job->ctx))) {
+        printf("Could not encrypt shard %u\n", i);
+    }
+    fclose(tmp);
+    return fclose(out) == 0 && ok;
+}
+
+// Decrypts one shard, checks it against the manifest, and writes it to its
+// place in the plaintext.
+//
+// Input parameters:
+// m: shard_manifest_t *: The manifest
+// i: uint32_t: Index of the shard
+// fd: int: Plaintext output file
+// fn: batch_fn: Function that decrypts one stream
+// ctx: void *: Context handed to fn
+// Returns: bool: True in case of success
+static bool shard_decrypt_one(shard_manifest_t *m, uint32_t i, int fd, batch_fn fn, void *ctx) {
+    shard_t *s = &m->shards[i];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    FILE *in, *tmp;
+    bool ok;
+
+    if ((in = fopen(s->path, "r")) == NULL) {
+        printf("Could not open %s\n", s->path);
+        return false;
+    }
+    if ((tmp = tmpfile()) == NULL) {
+        printf("Could not create a temporary file for shard %u\n", i);
+        fclose(in);
+        return false;
+    }
+    ok = fn(in, tmp, ctx);
+    fclose(in);
+
+    // Nothing is written unless the whole shard decrypted correctly.
+    rewind(tmp);
+    if (!ok || shard_copy(tmp, NULL, UINT64_MAX, digest) != s->length
+        || memcmp(digest, s->digest, SHA256_DIGEST_SIZE)) {
+        printf("Shard %u does not match its checksum\n", i);
+        fclose(tmp);
+        return false;
+    }
+    rewind(tmp);
+    if (!(ok = shard_pwrite(tmp, fd, s->offset))) {
+        printf("Could not write shard %u\n", i);
+    }
+    fclose(tmp);
+    return ok;
+}
+
+// Step function of shard_merge.
+static bool shard_merge_one(shard_job_t *job, uint32_t i) {
+    return shard_decrypt_one(job->m, i, job->fd, job->fn, job->ctx);
+}
+
+// Writes the manifest of a sharded ciphertext.
+//
+// Input parameters:
+// m: shard_manifest_t *: The manifest
+// path: char *: Manifest file to create
+// Returns: bool: True in case of success
+static bool shard_write_manifest(shard_manifest_t *m, char *path) {
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+    FILE *fp;
+
+    if ((fp = fopen(path, "w")) == NULL) {
+        printf("Could not create %s\n", path);
+        return false;
+    }
+    fprintf(fp, "%s\n%" PRIu32 " %" PRIu64 "\n", SHARD_MAGIC, m->count, m->total);
+    for (uint32_t i = 0; i < m->count; i++) {
+        shard_t *s = &m->shards[i];
+        char *name = strrchr(s->path, '/');
+        hex[hex_encode(hex, s->digest, SHA256_DIGEST_SIZE)] = '\0';
+        fprintf(fp, "%" PRIu64 " %" PRIu64 " %s %s\n", s->offset, s->length, hex,
+            name != NULL ? name + 1 : s->path);
+    }
+    return fclose(fp) == 0;
+}
+
+// Checks that a shard name from a manifest names a file in the manifest's
+// own directory, so that a manifest cannot point decrypt at other files.
+//
+// Input parameters:
+// name: char *: Shard file name
+// Returns: bool: True if name has no '/' and is not "." or ".."
+static bool shard_name_ok(char *name) {
+    return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") && strcmp(name, "..");
+}
+
+// Reads the manifest of a sharded ciphertext. Shard names are resolved
+// relative to the manifest's directory.
+//
+// Input parameters:
+// m: shard_manifest_t *: The manifest is stored here. The caller frees
+// m->shards
+// path: char *: Manifest file to read
+// Returns: bool: True in case of success
+static bool shard_read_manifest(shard_manifest_t *m, char *path) {
+    char line[64];
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+    char name[NAME_MAX + 1];
+    char *slash = strrchr(path, '/');
+    int dirlen = slash != NULL ? (int) (slash - path) : 0;
+    FILE *fp;
+
+    m->shards = NULL;
+    if ((fp = fopen(path, "r")) == NULL) {
+        printf("Could not open %s\n", path);
+        return false;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, SHARD_MAGIC "\n")
+        || fscanf(fp, "%" SCNu32 " %" SCNu64, &m->count, &m->total) != 2 || m->count == 0
+        || m->count > SHARD_MAX) {
+        printf("%s is not a shard manifest\n", path);
+        fclose(fp);
+        return false;
+    }
+
+    m->shards = (shard_t *) calloc(m->count, sizeof(shard_t));
+    for (uint32_t i = 0; i < m->count; i++) {
+        shard_t *s = &m->shards[i];
+        int len;
+        if (fscanf(fp, "%" SCNu64 " %" SCNu64 " %64s %255[^\n]", &s->offset, &s->length, hex,
+                name)
+                != 4
+            || !shard_name_ok(name) || strlen(hex) != 2 * SHA256_DIGEST_SIZE
+            || !hex_decode(s->digest, hex, SHA256_DIGEST_SIZE) || s->offset > m->total
+            || s->length > m->total - s->offset) {
+            printf("Entry %u of %s is invalid\n", i, path);
+            fclose(fp);
+            return false;
+        }
+        if (slash != NULL) {
+            len = snprintf(s->path, sizeof(s->path), "%.*s/%s", dirlen, path, name);
+        } else {
+            len = snprintf(s->path, sizeof(s->path), "%s", name);
+        }
+        if (len < 0 || (size_t) len >= sizeof(s->path)) {
+            printf("Entry %u of %s is invalid\n", i, path);
+            fclose(fp);
+            return false;
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// Opens the plaintext output of a sharded decryption. The file is not
+// truncated, since other processes may be writing other shards to it; it is
+// only set to the size of the plaintext.
+//
+// Input parameters:
+// outfile: char *: Plaintext output file
+// total: uint64_t: Size of the plaintext
+// Returns: int: File descriptor, or -1 in case of failure
+static int shard_open_output(char *outfile, uint64_t total) {
+    int fd;
+
+    if ((fd = open(outfile, O_WRONLY | O_CREAT, 0644)) < 0) {
+        printf("The output file is invalid. Please provide a valid output file\n");
+        return -1;
+    }
+    if (ftruncate(fd, total) != 0) {
+        printf("Could not resize %s\n", outfile);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Splits infile into nshards ranges and encrypts each into <outfile>.<i>,
+// in parallel, then writes <outfile>.manifest. Range boundaries fall on
+// multiples of align, normally the number of plaintext bytes in a block,
+// so the shards hold the same full blocks as a single ciphertext would.
+//
+// Input parameters:
+// infile: char *: Plaintext file, which must be a regular file
+// outfile: char *: Prefix of the shard and manifest files
+// nshards: uint32_t: Number of shards
+// align: uint64_t: Alignment of the range boundaries
+// fn: batch_fn: Function that encrypts one stream
+// ctx: void *: Context handed to fn
+// nthreads: uint32_t: Number of worker threads
+// verbose: bool: Print each shard
+// Returns: bool: True in case of success
+bool shard_encrypt(char *infile, char *outfile, uint32_t nshards, uint64_t align, batch_fn fn,
+    void *ctx, uint32_t nthreads, bool verbose) {
+    shard_manifest_t m;
+    shard_job_t job = { 0 };
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t blocks, first = 0;
+    int len;
+    bool ok;
+
+    if (nshards == 0 || nshards > SHARD_MAX || align == 0) {
+        printf("The number of shards must be between 1 and %d\n", SHARD_MAX);
+        return false;
+    }
+    if (stat(infile, &st) != 0 || !S_ISREG(st.st_mode)) {
+        printf("Sharding requires a regular input file\n");
+        return false;
+    }
+
+    m.count = nshards;
+    m.total = st.st_size;
+    m.shards = (shard_t *) calloc(nshards, sizeof(shard_t));
+
+    // Spread the blocks evenly, the first shards taking one extra block
+    // each when they do not divide evenly.
+    blocks = (m.total + align - 1) / align;
+    for (uint32_t i = 0; i < nshards; i++) {
+        uint64_t count = blocks / nshards + (i < blocks % nshards);
+        uint64_t start = first * align < m.total ? first * align : m.total;
+        uint64_t end = (first + count) * align < m.total ? (first + count) * align : m.total;
+        m.shards[i].offset = start;
+        m.shards[i].length = end - start;
+        first += count;
+
+        len = snprintf(m.shards[i].path, sizeof(m.shards[i].path), "%s.%u", outfile, i);
+        if (len < 0 || (size_t) len >= sizeof(m.shards[i].path)) {
+            printf("The output file is invalid. Please provide a valid output file\n");
+            free(m.shards);
+            return false;
+        }
+    }
+
+    job.m = &m;
+    job.infile = infile;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.step = shard_encrypt_one;
+    ok = shard_run(&job, nthreads) == 0;
+
+    if (verbose) {
+        for (uint32_t i = 0; i < nshards; i++) {
+            printf("shard %u: %" PRIu64 " bytes at %" PRIu64 " -> %s\n", i, m.shards[i].length,
+                m.shards[i].offset, m.shards[i].path);
+        }
+    }
+
+    // The manifest is written last, so that it only exists once every shard
+    // does.
+    len = snprintf(path, sizeof(path), "%s.manifest", outfile);
+    if (ok && (len < 0 || (size_t) len >= sizeof(path) || !shard_write_manifest(&m, path))) {
+        ok = false;
+    }
+
+    free(m.shards);
+    return ok;
+}
+
+// Decrypts shard index of a sharded ciphertext, and writes it at its offset
+// in outfile. Several processes may decrypt different shards into the same
+// outfile at once.
+//
+// Input parameters:
+// manifest: char *: Manifest of the sharded ciphertext
+// index: uint32_t: Index of the shard to decrypt
+// outfile: char *: Plaintext output file
+// fn: batch_fn: Function that decrypts one stream
+// ctx: void *: Context handed to fn
+// Returns: bool: True in case of success
+bool shard_decrypt(char *manifest, uint32_t index, char *outfile, batch_fn fn, void *ctx) {
+    shard_manifest_t m;
+    bool ok = false;
+    int fd;
+
+    if (shard_read_manifest(&m, manifest)) {
+        if (index >= m.count) {
+            printf("There is no shard %u in %s\n", index, manifest);
+        } else if ((fd = shard_open_output(outfile, m.total)) >= 0) {
+            ok = shard_decrypt_one(&m, index, fd, fn, ctx);
+            ok = close(fd) == 0 && ok;
+        }
+    }
+
+    free(m.shards);
+    return ok;
+}
+
+// Decrypts every shard of a sharded ciphertext in parallel, assembling the
+// plaintext in outfile.
+//
+// Input parameters:
+// manifest: char *: Manifest of the sharded ciphertext
+// outfile: char *: Plaintext output file
+// fn: batch_fn: Function that decrypts one stream
+// ctx: void *: Context handed to fn
+// nthreads: uint32_t: Number of worker threads
+// Returns: bool: True in case of success
+bool shard_merge(char *manifest, char *outfile, batch_fn fn, void *ctx, uint32_t nthreads) {
+    shard_manifest_t m;
+    shard_job_t job = { 0 };
+    bool ok = false;
+
+    if (shard_read_manifest(&m, manifest) && (job.fd = shard_open_output(outfile, m.total)) >= 0) {
+        job.m = &m;
+        job.fn = fn;
+        job.ctx = ctx;
+        job.step = shard_merge_one;
+        ok = shard_run(&job, nthreads) == 0;
+        ok = close(job.fd) == 0 && ok;
+    }
+
+    free(m.shards);
+    return ok;
+}
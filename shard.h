@@ -0,0 +1,13 @@
+#pragma once
+
+#include "batch.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool shard_encrypt(char *infile, char *outfile, uint32_t nshards, uint64_t align, batch_fn fn,
+    void *ctx, uint32_t nthreads, bool verbose);
+
+bool shard_decrypt(char *manifest, uint32_t index, char *outfile, batch_fn fn, void *ctx);
+
+bool shard_merge(char *manifest, char *outfile, batch_fn fn, void *ctx, uint32_t nthreads);
@@ -0,0 +1,191 @@
+#include "vcache.h"
+#include "sha256.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// A cache of public keys whose signature has been verified, so that encrypt
+// can skip rsa_verify for a key it has already checked. It lives in
+// $XDG_CACHE_HOME/rsa/verify.cache (or ~/.cache/rsa/verify.cache) and is
+// a small direct-mapped table, accessed through mmap under an flock.
+//
+// An entry is keyed by the SHA-256 of (n, e, s, username), and also records
+// the identity and modification time of the public key file it was read
+// from. Replacing or touching the key file invalidates the entry.
+
+#define VCACHE_MAGIC "RSAVC001"
+#define VCACHE_SLOTS 64
+
+typedef struct {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+} vcache_entry_t;
+
+typedef struct {
+    char magic[8];
+    vcache_entry_t slots[VCACHE_SLOTS];
+} vcache_file_t;
+
+// Hashes the public key.
+//
+// Input parameters:
+// digest: uint8_t[]: The digest is stored here
+// n, e, s: mpz_t: Constituents of the public key
+// username: char[]
+// Returns: void
+static void vcache_digest(
+    uint8_t digest[SHA256_DIGEST_SIZE], mpz_t n, mpz_t e, mpz_t s, char username[]) {
+    mpz_ptr parts[3] = { n, e, s };
+    sha256_t ctx;
+    uint64_t len;
+
+    // Each part is length prefixed, so that different keys cannot hash the
+    // same input.
+    sha256_init(&ctx);
+    for (int i = 0; i < 3; i++) {
+        size_t count;
+        void *bytes = mpz_export(NULL, &count, 1, 1, 1, 0, parts[i]);
+        len = count;
+        sha256_update(&ctx, &len, sizeof(len));
+        sha256_update(&ctx, bytes, count);
+        free(bytes);
+    }
+    len = strlen(username);
+    sha256_update(&ctx, &len, sizeof(len));
+    sha256_update(&ctx, username, len);
+    sha256_final(&ctx, digest);
+}
+
+// Creates dir if it does not exist, with owner only permissions.
+static bool vcache_mkdir(char *dir) {
+    return mkdir(dir, S_IRWXU) == 0 || errno == EEXIST;
+}
+
+// Opens (creating it if needed) and maps the cache file, and locks it.
+//
+// Input parameters:
+// fd: int *: File descriptor of the cache file is stored here
+// Returns: vcache_file_t *: The mapped cache, or NULL if it is unavailable
+static vcache_file_t *vcache_open(int *fd) {
+    char path[PATH_MAX];
+    char *base = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    vcache_file_t *cache;
+    struct stat st;
+
+    // Build the path one directory at a time, creating what is missing.
+    if (base != NULL && *base) {
+        snprintf(path, sizeof(path), "%s", base);
+    } else if (home != NULL && *home) {
+        snprintf(path, sizeof(path), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    if (strlen(path) + sizeof("/rsa/verify.cache") > sizeof(path) || !vcache_mkdir(path)) {
+        return NULL;
+    }
+    strcat(path, "/rsa");
+    if (!vcache_mkdir(path)) {
+        return NULL;
+    }
+    strcat(path, "/verify.cache");
+
+    if ((*fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0) {
+        return NULL;
+    }
+    flock(*fd, LOCK_EX);
+
+    // Start over on a new, truncated or foreign file.
+    if (fstat(*fd, &st) != 0
+        || ((size_t) st.st_size != sizeof(vcache_file_t)
+            && (ftruncate(*fd, 0) != 0 || ftruncate(*fd, sizeof(vcache_file_t)) != 0))) {
+        close(*fd);
+        return NULL;
+    }
+    cache = mmap(NULL, sizeof(vcache_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (cache == MAP_FAILED) {
+        close(*fd);
+        return NULL;
+    }
+    if (memcmp(cache->magic, VCACHE_MAGIC, 8)) {
+        memset(cache, 0, sizeof(vcache_file_t));
+        memcpy(cache->magic, VCACHE_MAGIC, 8);
+    }
+    return cache;
+}
+
+// Unmaps, unlocks and closes the cache.
+static void vcache_close(vcache_file_t *cache, int fd) {
+    munmap(cache, sizeof(vcache_file_t));
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// Fills in an entry for the key, read from the file described by st.
+static void vcache_entry(
+    vcache_entry_t *ent, struct stat *st, mpz_t n, mpz_t e, mpz_t s, char username[]) {
+    memset(ent, 0, sizeof(vcache_entry_t));
+    vcache_digest(ent->digest, n, e, s, username);
+    ent->mtime_sec = st->st_mtim.tv_sec;
+    ent->mtime_nsec = st->st_mtim.tv_nsec;
+    ent->size = st->st_size;
+    ent->dev = st->st_dev;
+    ent->ino = st->st_ino;
+}
+
+// Checks whether the signature of a public key has already been verified.
+//
+// Input parameters:
+// st: struct stat *: Status of the public key file, taken when it was opened
+// n, e, s: mpz_t: Constituents of the public key
+// username: char[]
+// Returns: bool: True if a matching entry was found, in which case the
+// signature need not be verified again
+bool vcache_lookup(struct stat *st, mpz_t n, mpz_t e, mpz_t s, char username[]) {
+    vcache_entry_t want;
+    vcache_file_t *cache;
+    bool hit;
+    int fd;
+
+    if ((cache = vcache_open(&fd)) == NULL) {
+        return false;
+    }
+    vcache_entry(&want, st, n, e, s, username);
+    hit = !memcmp(&cache->slots[want.digest[0] % VCACHE_SLOTS], &want, sizeof(want));
+    vcache_close(cache, fd);
+    return hit;
+}
+
+// Records that the signature of a public key has been verified. This
+// replaces whatever entry was in its slot.
+//
+// Input parameters:
+// st: struct stat *: Status of the public key file, taken when it was opened
+// n, e, s: mpz_t: Constituents of the public key
+// username: char[]
+// Returns: void
+void vcache_insert(struct stat *st, mpz_t n, mpz_t e, mpz_t s, char username[]) {
+    vcache_entry_t ent;
+    vcache_file_t *cache;
+    int fd;
+
+    if ((cache = vcache_open(&fd)) == NULL) {
+        return;
+    }
+    vcache_entry(&ent, st, n, e, s, username);
+    cache->slots[ent.digest[0] % VCACHE_SLOTS] = ent;
+    msync(cache, sizeof(vcache_file_t), MS_SYNC);
+    vcache_close(cache, fd);
+}
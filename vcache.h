@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+bool vcache_lookup(struct stat *st, mpz_t n, mpz_t e, mpz_t s, char username[]);
+
+void vcache_insert(struct stat *st, mpz_t n, mpz_t e, mpz_t s, char username[]);